@@ -0,0 +1,248 @@
+
+/*
+ * bench_cpp.cpp
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Benchmarks the C++ layer against the C API it wraps, and checks that
+ * small tasks never touch the heap.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include "thread_pool.hpp"
+
+#define NUM_PACKETS (200000)
+#define NUM_TASKS (1000000)
+#define NUM_RUNS (5)
+#define NUM_WORKERS (4)
+
+/* Every heap allocation in the process goes through here. */
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(std::size_t size)
+{
+   void *p;
+
+   allocations++;
+   p = std::malloc(size ? size : 1);
+   if(!p) {
+      throw std::bad_alloc();
+   }
+   return p;
+}
+
+void operator delete(void *p) noexcept
+{
+   std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+   std::free(p);
+}
+
+struct order_t
+{
+   long id;
+   double price;
+   int quantity;
+};
+
+/* Trivially copyable, but only constructible from a value. */
+struct ticket_t
+{
+   explicit ticket_t(long n) : number(n) {}
+   long number;
+};
+
+static double now_ns()
+{
+   return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void check(bool ok, const char *what)
+{
+   if(!ok) {
+      std::printf("FAILED: %s\n", what);
+      std::exit(EXIT_FAILURE);
+   }
+}
+
+/* What the C++ queue replaces: memcpy in and out of workq_msg_t by hand. */
+static double bench_c_queue()
+{
+   WorkQ_t q = workq_init(NULL, 0);
+   workq_msg_t msg;
+   order_t in = { 0, 1.5, 10 };
+   order_t out;
+   long sum = 0;
+   double start;
+   double elapsed;
+
+   check(q != NULL, "workq_init");
+
+   start = now_ns();
+   for(long x = 0; x < NUM_PACKETS; ++x) {
+      in.id = x;
+      workq_add(reinterpret_cast<const unsigned char *>(&in), sizeof(in), q, 1);
+      workq_get(q, &msg);
+      std::memcpy(&out, msg.data, sizeof(out));
+      sum += out.id;
+   }
+   elapsed = now_ns() - start;
+
+   check(sum == (long)NUM_PACKETS * (NUM_PACKETS - 1) / 2, "C packets intact");
+   workq_destroy(q);
+
+   return elapsed / NUM_PACKETS;
+}
+
+static double bench_cpp_queue()
+{
+   thread_pool::work_queue<order_t> q;
+   order_t in = { 0, 1.5, 10 };
+   long sum = 0;
+   double start;
+   double elapsed;
+
+   start = now_ns();
+   for(long x = 0; x < NUM_PACKETS; ++x) {
+      in.id = x;
+      q.push(in, 1);
+      sum += q.pop().id;
+   }
+   elapsed = now_ns() - start;
+
+   check(sum == (long)NUM_PACKETS * (NUM_PACKETS - 1) / 2, "C++ packets intact");
+
+   return elapsed / NUM_PACKETS;
+}
+
+int main()
+{
+   std::atomic<long> counter(0);
+   unsigned long before;
+   double best_c = 0;
+   double best_cpp = 0;
+   double worst_c = 0;
+   double worst_cpp = 0;
+   double start;
+
+   /* Untimed, so neither side pays for the cold caches and page faults. */
+   bench_c_queue();
+   bench_cpp_queue();
+
+   std::printf("Typed queue vs hand written C, %d packets, %d runs, alternating which goes first:\n", NUM_PACKETS, NUM_RUNS);
+   for(int run = 0; run < NUM_RUNS; ++run) {
+      double c;
+      double cpp;
+
+      if(run % 2) {
+         cpp = bench_cpp_queue();
+         c = bench_c_queue();
+      } else {
+         c = bench_c_queue();
+         cpp = bench_cpp_queue();
+      }
+
+      if(!run || c < best_c) {
+         best_c = c;
+      }
+      if(!run || cpp < best_cpp) {
+         best_cpp = cpp;
+      }
+      if(c > worst_c) {
+         worst_c = c;
+      }
+      if(cpp > worst_cpp) {
+         worst_cpp = cpp;
+      }
+   }
+   std::printf("   C   %8.1f to %8.1f ns per add and get\n", best_c, worst_c);
+   std::printf("   C++ %8.1f to %8.1f ns per push and pop\n", best_cpp, worst_cpp);
+   std::printf("   best C++ vs best C: %+.1f%%\n", (best_cpp - best_c) * 100.0 / best_c);
+
+   std::printf("Values without a default constructor...\n");
+   {
+      thread_pool::work_queue<ticket_t> q;
+
+      q.push(ticket_t(7), 1);
+      check(q.pop().number == 7, "value built from the packet");
+   }
+
+   std::printf("Owning pointers through a private queue...\n");
+   {
+      thread_pool::work_queue<std::unique_ptr<order_t> > q;
+      std::unique_ptr<order_t> order(new order_t());
+
+      order->id = 42;
+      q.push(std::move(order));
+      check(!order, "pointer moved into the queue");
+      check(q.pop()->id == 42, "pointer moved out of the queue");
+
+      /* Left queued, deleted with the queue. */
+      q.push(std::unique_ptr<order_t>(new order_t()));
+   }
+
+   std::printf("Small closures stay inline...\n");
+   {
+      long a = 1;
+      long b = 2;
+      char big[256] = { 0 };
+
+      before = allocations;
+      thread_pool::task small([&counter, a, b] { counter += a + b; });
+      thread_pool::task moved(std::move(small));
+      moved();
+      check(allocations == before, "small closure allocated");
+      check(moved.is_inline() && !small, "small closure stored inline");
+
+      thread_pool::task large([&counter, big] { counter += big[0]; });
+      check(allocations == before + 1 && !large.is_inline(), "large closure goes to the heap once");
+   }
+
+   std::printf("Task pool, %d workers, %d tasks...\n", NUM_WORKERS, NUM_TASKS);
+   {
+      thread_pool::task_pool tasks(NUM_WORKERS);
+
+      counter = 0;
+      before = allocations;
+      start = now_ns();
+      for(long x = 0; x < NUM_TASKS; ++x) {
+         tasks.submit([&counter, x] { counter += x & 1; });
+      }
+      tasks.wait();
+      std::printf("   %8.1f ns per task\n", (now_ns() - start) / NUM_TASKS);
+
+      check(allocations == before, "submitting small tasks allocated");
+      check(counter == NUM_TASKS / 2, "every task ran once");
+   }
+
+   std::printf("Tests passed.\n");
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,863 @@
+/*
+ * journal.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Layout of the journal directory:
+ *
+ *   ctl           head and tail of the log, shared by every process
+ *   seg.NNNNNNNN  segments from head to tail, appended to in order
+ *   spare.N       fully retired segments kept around for reuse
+ *
+ * A record is stamped with the number of the segment it was written
+ * to and a checksum. A spare renamed into a new segment still holds
+ * the old records, but they carry the old number, so the segment never
+ * needs to be cleared and the first stale or torn record marks the end
+ * of the log.
+ *
+ * The ctl file is flock()ed around anything that changes the head or
+ * tail, which covers other processes. The process mutex covers the
+ * other threads and the cache of mapped segments.
+ *
+ * Appends are only flushed every sync_every records (or sync_interval),
+ * so a single msync() covers a whole batch. Retirements aren't flushed
+ * at all until then, so after a crash a record may be seen again. A
+ * flusher thread per journal object flushes a batch that is still open
+ * sync_interval after its first append, so a burst followed by silence
+ * isn't left unflushed until the next append.
+ *
+ * A record starts out appended and becomes pending when the writer
+ * commits it. One that stays appended was left behind by a writer that
+ * died in between, journal_uncommitted() finds those. Both count as
+ * live, and taking either retires it, so handing a record out twice
+ * only ever delivers it once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC (0x4a726e6c)
+#define JOURNAL_SEG_MAGIC (0x5365676d)
+#define JOURNAL_VERSION (1)
+
+/* Segments mapped at once per process, direct mapped by number. */
+#define JOURNAL_MAP_SLOTS (16)
+
+/* Retired segments kept for reuse instead of unlinked. */
+#define JOURNAL_MAX_SPARES (2)
+
+#define JOURNAL_MIN_SEGMENT (64 * 1024)
+
+/* Record states */
+#define J_FREE (0)
+#define J_PENDING (1)
+#define J_DONE (2)
+#define J_END (3) /* Rest of the segment is unused. */
+#define J_APPENDED (4) /* Written, not yet committed. */
+
+typedef struct jctl_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t segment_size;
+	uint32_t head;
+	uint32_t tail;
+	uint64_t tail_off;
+	uint64_t synced_off;
+	uint64_t first_unsynced_ns;
+	uint32_t unsynced;
+	uint32_t spares;
+} jctl_t;
+
+typedef struct jseg_t {
+	uint32_t magic;
+	uint32_t seg;
+	uint32_t live; /* Pending records, changed with atomic builtins from any process. */
+	uint32_t reserved;
+} jseg_t;
+
+typedef struct jrec_t {
+	uint32_t state;
+	uint32_t seg;
+	uint32_t size;
+	uint32_t sum;
+	int64_t prio;
+	unsigned char data[];
+} jrec_t;
+
+typedef struct jmap_t {
+	uint32_t seg;
+	unsigned char *base;
+} jmap_t;
+
+typedef struct journal_t {
+	uint32_t magic;
+	char *dir;
+	int ctl_fd;
+	jctl_t *ctl;
+	size_t segment_size;
+	unsigned int sync_every;
+	uint64_t sync_interval_ns;
+	pthread_mutex_t mutex;
+	jmap_t maps[JOURNAL_MAP_SLOTS];
+	/* Flusher state, protected by flush_mutex. Taken inside mutex, never around it. */
+	pthread_t flusher;
+	int flushing;
+	int closing;
+	pthread_mutex_t flush_mutex;
+	pthread_cond_t flush_cond;
+	uint64_t flush_due_ns; /* When the open batch has to be flushed, 0 if the flusher has nothing to do. */
+} journal_t;
+
+static uint64_t _now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static size_t _rec_len(size_t size) {
+	return((sizeof(jrec_t) + size + 7) & ~(size_t)7);
+}
+
+/* FNV-1a over everything but the state, which is written last. */
+static uint32_t _rec_sum(const jrec_t *rec) {
+	const unsigned char *p = (const unsigned char *)&(rec->prio);
+	uint32_t h = 2166136261U ^ rec->seg ^ rec->size;
+	size_t x;
+
+	for(x = 0; x < sizeof(rec->prio); ++x) {
+		h = (h ^ p[x]) * 16777619U;
+	}
+	for(x = 0; x < rec->size; ++x) {
+		h = (h ^ rec->data[x]) * 16777619U;
+	}
+
+	return(h);
+}
+
+/* Returns the record at off if it belongs to segment seg and is intact. */
+static jrec_t *_rec_at(journal_t *j, unsigned char *base, uint32_t seg, uint64_t off) {
+	jrec_t *rec;
+
+	if(off + sizeof(jrec_t) > j->segment_size) {
+		return(NULL);
+	}
+
+	rec = (jrec_t *)(base + off);
+	if(rec->seg != seg) {
+		return(NULL);
+	}
+
+	if(rec->state == J_END) {
+		return(rec);
+	}
+
+	if(rec->state != J_PENDING && rec->state != J_APPENDED && rec->state != J_DONE) {
+		return(NULL);
+	}
+
+	if(off + _rec_len(rec->size) > j->segment_size || rec->sum != _rec_sum(rec)) {
+		return(NULL);
+	}
+
+	return(rec);
+}
+
+static void _seg_path(journal_t *j, uint32_t seg, char *path, size_t len) {
+	snprintf(path, len, "%s/seg.%08x", j->dir, seg);
+}
+
+static void _spare_path(journal_t *j, uint32_t spare, char *path, size_t len) {
+	snprintf(path, len, "%s/spare.%u", j->dir, spare);
+}
+
+static void _unmap(journal_t *j, uint32_t seg) {
+	jmap_t *map = &(j->maps[seg % JOURNAL_MAP_SLOTS]);
+
+	if(map->base && map->seg == seg) {
+		munmap(map->base, j->segment_size);
+		map->base = NULL;
+	}
+}
+
+/*
+ * WARNING: Only called with the process mutex held, the mapping is only
+ * good until the next call. A fresh segment gets a new header, anything
+ * else has to already carry the right one.
+ */
+static unsigned char *_map(journal_t *j, uint32_t seg, int fresh) {
+	char path[4096];
+	jmap_t *map = &(j->maps[seg % JOURNAL_MAP_SLOTS]);
+	jseg_t *hdr;
+	void *base;
+	int fd;
+
+	if(map->base && map->seg == seg && !fresh) {
+		return(map->base);
+	}
+
+	if(map->base) {
+		munmap(map->base, j->segment_size);
+		map->base = NULL;
+	}
+
+	_seg_path(j, seg, path, sizeof(path));
+	fd = open(path, O_RDWR);
+	if(fd < 0) {
+		return(NULL);
+	}
+
+	base = mmap(NULL, j->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		return(NULL);
+	}
+
+	hdr = (jseg_t *)base;
+	if(fresh) {
+		hdr->seg = seg;
+		hdr->live = 0;
+		hdr->magic = JOURNAL_SEG_MAGIC;
+		msync(base, sizeof(*hdr), MS_SYNC);
+	} else if(hdr->magic != JOURNAL_SEG_MAGIC || hdr->seg != seg) {
+		munmap(base, j->segment_size);
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	map->seg = seg;
+	map->base = base;
+
+	return(map->base);
+}
+
+/* WARNING: Only called with both locks held. Puts a segment file in place for seg, reusing a spare if there is one. */
+static int _seg_create(journal_t *j, uint32_t seg) {
+	char path[4096];
+	char spare[4096];
+	int fd;
+	int rv;
+
+	_seg_path(j, seg, path, sizeof(path));
+
+	if(j->ctl->spares) {
+		_spare_path(j, j->ctl->spares - 1, spare, sizeof(spare));
+		if(!rename(spare, path)) {
+			j->ctl->spares--;
+			return(0);
+		}
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0660);
+	if(fd < 0) {
+		return(-1);
+	}
+
+	/* Allocate the blocks up front, so appends never extend the file. */
+	rv = posix_fallocate(fd, 0, j->segment_size);
+	if(rv) {
+		rv = ftruncate(fd, j->segment_size);
+	}
+	close(fd);
+
+	return(rv);
+}
+
+/* WARNING: Only called with both locks held. */
+static void _sync_locked(journal_t *j) {
+	unsigned char *base;
+	uint64_t start;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if(j->ctl->synced_off < j->ctl->tail_off) {
+		base = _map(j, j->ctl->tail, 0);
+		if(base) {
+			start = j->ctl->synced_off & ~(uint64_t)(page - 1);
+			msync(base + start, j->ctl->tail_off - start, MS_SYNC);
+		}
+		j->ctl->synced_off = j->ctl->tail_off;
+	}
+
+	j->ctl->unsynced = 0;
+	msync(j->ctl, sizeof(*j->ctl), MS_ASYNC);
+}
+
+/* WARNING: Only called with both locks held. Recycles fully retired segments at the head. */
+static void _advance_head(journal_t *j) {
+	char path[4096];
+	char spare[4096];
+	unsigned char *base;
+
+	while(j->ctl->head < j->ctl->tail) {
+		base = _map(j, j->ctl->head, 0);
+		if(base && __sync_fetch_and_add(&(((jseg_t *)base)->live), 0)) {
+			break;
+		}
+
+		_unmap(j, j->ctl->head);
+		_seg_path(j, j->ctl->head, path, sizeof(path));
+
+		if(j->ctl->spares < JOURNAL_MAX_SPARES) {
+			_spare_path(j, j->ctl->spares, spare, sizeof(spare));
+			if(!rename(path, spare)) {
+				j->ctl->spares++;
+			}
+		} else {
+			unlink(path);
+		}
+
+		j->ctl->head++;
+	}
+}
+
+/* WARNING: Only called with both locks held. */
+static int _roll(journal_t *j) {
+	uint32_t seg = j->ctl->tail + 1;
+
+	if(_seg_create(j, seg) || !_map(j, seg, 1)) {
+		return(-1);
+	}
+
+	j->ctl->tail = seg;
+	j->ctl->tail_off = sizeof(jseg_t);
+	j->ctl->synced_off = j->ctl->tail_off;
+
+	_advance_head(j);
+
+	return(0);
+}
+
+/* WARNING: Only called with both locks held. Finds the real end of the log and recounts the live records. */
+static int _recover(journal_t *j) {
+	uint32_t seg = j->ctl->head;
+	uint32_t last;
+	uint64_t last_off = sizeof(jseg_t);
+	unsigned char *base = NULL;
+
+	/* Segments retired by a process that crashed before it updated ctl. */
+	while(seg <= j->ctl->tail && !(base = _map(j, seg, 0))) {
+		seg++;
+	}
+
+	if(!base) {
+		/* Nothing usable left, start over after the old tail. */
+		j->ctl->head = j->ctl->tail;
+		if(_roll(j)) {
+			return(-1);
+		}
+		j->ctl->head = j->ctl->tail;
+		return(0);
+	}
+
+	j->ctl->head = seg;
+	last = seg;
+
+	/* ctl may be behind, so keep going as long as there are segments. */
+	for( ; (base = _map(j, seg, 0)); ++seg) {
+		uint64_t off = sizeof(jseg_t);
+		uint32_t live = 0;
+		jrec_t *rec;
+
+		while((rec = _rec_at(j, base, seg, off)) && rec->state != J_END) {
+			if(rec->state == J_PENDING || rec->state == J_APPENDED) {
+				live++;
+			}
+			off += _rec_len(rec->size);
+		}
+
+		((jseg_t *)base)->live = live;
+		last = seg;
+		last_off = off;
+	}
+
+	j->ctl->tail = last;
+	j->ctl->tail_off = last_off;
+	j->ctl->synced_off = last_off;
+	j->ctl->unsynced = 0;
+
+	_advance_head(j);
+
+	return(0);
+}
+
+static void _lock(journal_t *j) {
+	pthread_mutex_lock(&(j->mutex));
+	flock(j->ctl_fd, LOCK_EX);
+}
+
+static void _unlock(journal_t *j) {
+	flock(j->ctl_fd, LOCK_UN);
+	pthread_mutex_unlock(&(j->mutex));
+}
+
+/* Flushes each batch once it's been open for sync_interval, appends or not. */
+static void *_flusher(void *arg) {
+	struct timespec until;
+	journal_t *j = (journal_t*)arg;
+
+	pthread_mutex_lock(&(j->flush_mutex));
+
+	while(!j->closing) {
+		if(!j->flush_due_ns) {
+			pthread_cond_wait(&(j->flush_cond), &(j->flush_mutex));
+			continue;
+		}
+
+		if(_now_ns() < j->flush_due_ns) {
+			until.tv_sec = j->flush_due_ns / 1000000000ULL;
+			until.tv_nsec = j->flush_due_ns % 1000000000ULL;
+			pthread_cond_timedwait(&(j->flush_cond), &(j->flush_mutex), &until);
+			continue;
+		}
+
+		/* Appends take flush_mutex under the journal locks, so let go first.
+		 * Whatever is unflushed by now goes too, early is harmless.
+		 */
+		j->flush_due_ns = 0;
+		pthread_mutex_unlock(&(j->flush_mutex));
+
+		_lock(j);
+		if(j->ctl->unsynced) {
+			_sync_locked(j);
+		}
+		_unlock(j);
+
+		pthread_mutex_lock(&(j->flush_mutex));
+	}
+
+	pthread_mutex_unlock(&(j->flush_mutex));
+
+	return(NULL);
+}
+
+Journal_t journal_open(const char *dir, size_t segment_size, unsigned int sync_every, uint64_t sync_interval_ns, int recover) {
+	char path[4096];
+	struct stat st;
+	pthread_condattr_t attr;
+	journal_t *j;
+	void *ctl;
+	int fresh;
+
+	j = calloc(1, sizeof(journal_t));
+	if(!j) {
+		return(NULL);
+	}
+
+	j->dir = strdup(dir);
+	j->sync_every = sync_every ? sync_every : 1;
+	j->sync_interval_ns = sync_interval_ns;
+	pthread_mutex_init(&(j->mutex), NULL);
+	pthread_mutex_init(&(j->flush_mutex), NULL);
+
+	/* Flush deadlines must not jump with the wall clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(j->flush_cond), &attr);
+	pthread_condattr_destroy(&attr);
+
+	snprintf(path, sizeof(path), "%s/ctl", dir);
+	j->ctl_fd = open(path, O_RDWR | O_CREAT, 0660);
+	if(!j->dir || j->ctl_fd < 0) {
+		goto fail;
+	}
+
+	_lock(j);
+
+	if(fstat(j->ctl_fd, &st)) {
+		goto fail_locked;
+	}
+
+	fresh = (st.st_size < sizeof(jctl_t));
+	if(fresh && ftruncate(j->ctl_fd, sizeof(jctl_t))) {
+		goto fail_locked;
+	}
+
+	ctl = mmap(NULL, sizeof(jctl_t), PROT_READ | PROT_WRITE, MAP_SHARED, j->ctl_fd, 0);
+	if(ctl == MAP_FAILED) {
+		goto fail_locked;
+	}
+	j->ctl = (jctl_t *)ctl;
+
+	if(fresh) {
+		if(segment_size < JOURNAL_MIN_SEGMENT) {
+			segment_size = JOURNAL_MIN_SEGMENT;
+		}
+
+		memset(j->ctl, 0, sizeof(*j->ctl));
+		j->ctl->segment_size = segment_size;
+		j->segment_size = segment_size;
+
+		/* _roll() moves on from the tail, so start one before segment zero. */
+		j->ctl->tail = (uint32_t)-1;
+		if(_roll(j)) {
+			goto fail_locked;
+		}
+		j->ctl->head = j->ctl->tail;
+
+		j->ctl->version = JOURNAL_VERSION;
+		j->ctl->magic = JOURNAL_MAGIC;
+		msync(j->ctl, sizeof(*j->ctl), MS_SYNC);
+	} else {
+		if(j->ctl->magic != JOURNAL_MAGIC || j->ctl->version != JOURNAL_VERSION) {
+			errno = EINVAL;
+			goto fail_locked;
+		}
+		j->segment_size = j->ctl->segment_size;
+
+		if(recover && _recover(j)) {
+			goto fail_locked;
+		}
+	}
+
+	_unlock(j);
+
+	if(j->sync_interval_ns) {
+		if(pthread_create(&(j->flusher), NULL, _flusher, j)) {
+			goto fail;
+		}
+		j->flushing = 1;
+	}
+
+	j->magic = JOURNAL_MAGIC;
+
+	return((Journal_t)j);
+
+fail_locked:
+	_unlock(j);
+fail:
+	if(j->ctl) {
+		munmap(j->ctl, sizeof(*j->ctl));
+	}
+	if(j->ctl_fd >= 0) {
+		close(j->ctl_fd);
+	}
+	pthread_cond_destroy(&(j->flush_cond));
+	pthread_mutex_destroy(&(j->flush_mutex));
+	pthread_mutex_destroy(&(j->mutex));
+	free(j->dir);
+	free(j);
+	return(NULL);
+}
+
+void journal_close(Journal_t journal) {
+	unsigned int x;
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		return;
+	}
+
+	if(j->flushing) {
+		pthread_mutex_lock(&(j->flush_mutex));
+		j->closing = 1;
+		pthread_cond_signal(&(j->flush_cond));
+		pthread_mutex_unlock(&(j->flush_mutex));
+		pthread_join(j->flusher, NULL);
+		j->flushing = 0;
+	}
+
+	journal_sync(journal);
+
+	j->magic = 0;
+
+	for(x = 0; x < JOURNAL_MAP_SLOTS; ++x) {
+		if(j->maps[x].base) {
+			munmap(j->maps[x].base, j->segment_size);
+		}
+	}
+
+	munmap(j->ctl, sizeof(*j->ctl));
+	close(j->ctl_fd);
+	pthread_cond_destroy(&(j->flush_cond));
+	pthread_mutex_destroy(&(j->flush_mutex));
+	pthread_mutex_destroy(&(j->mutex));
+	free(j->dir);
+	free(j);
+}
+
+int journal_append(Journal_t journal, long prio, const unsigned char *data, size_t size, journal_loc_t *loc) {
+	size_t len = _rec_len(size);
+	unsigned char *base;
+	jrec_t *rec;
+	uint64_t now;
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(sizeof(jseg_t) + len > j->segment_size) {
+		errno = EMSGSIZE;
+		return(-1);
+	}
+
+	_lock(j);
+
+	if(j->ctl->tail_off + len > j->segment_size) {
+		base = _map(j, j->ctl->tail, 0);
+		if(!base) {
+			_unlock(j);
+			return(-1);
+		}
+
+		if(j->ctl->tail_off + sizeof(jrec_t) <= j->segment_size) {
+			rec = (jrec_t *)(base + j->ctl->tail_off);
+			rec->seg = j->ctl->tail;
+			rec->state = J_END;
+		}
+
+		/* A segment is complete on disk before the next one exists, so
+		 * recovery never has to look past a torn record.
+		 */
+		msync(base, j->segment_size, MS_SYNC);
+
+		if(_roll(j)) {
+			_unlock(j);
+			return(-1);
+		}
+	}
+
+	base = _map(j, j->ctl->tail, 0);
+	if(!base) {
+		_unlock(j);
+		return(-1);
+	}
+
+	rec = (jrec_t *)(base + j->ctl->tail_off);
+	rec->seg = j->ctl->tail;
+	rec->size = size;
+	rec->prio = prio;
+	memcpy(rec->data, data, size);
+	rec->sum = _rec_sum(rec);
+
+	/* The state makes the record visible, it goes last. */
+	__sync_synchronize();
+	rec->state = J_APPENDED;
+	__sync_fetch_and_add(&(((jseg_t *)base)->live), 1);
+
+	loc->seg = j->ctl->tail;
+	loc->off = j->ctl->tail_off;
+	j->ctl->tail_off += len;
+
+	/* Group commit: one flush for the whole batch. */
+	now = _now_ns();
+	if(!j->ctl->unsynced++) {
+		j->ctl->first_unsynced_ns = now;
+	}
+	if(j->ctl->unsynced >= j->sync_every || now - j->ctl->first_unsynced_ns >= j->sync_interval_ns) {
+		_sync_locked(j);
+	}
+
+	/* Still open, make sure the flusher gets to it if no append does. */
+	if(j->ctl->unsynced && j->flushing) {
+		pthread_mutex_lock(&(j->flush_mutex));
+		if(!j->flush_due_ns) {
+			j->flush_due_ns = j->ctl->first_unsynced_ns + j->sync_interval_ns;
+			pthread_cond_signal(&(j->flush_cond));
+		}
+		pthread_mutex_unlock(&(j->flush_mutex));
+	}
+
+	_unlock(j);
+
+	return(0);
+}
+
+int journal_commit(Journal_t journal, journal_loc_t loc) {
+	unsigned char *base;
+	jrec_t *rec;
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(j->mutex));
+
+	/* Taken already is fine too, there's nothing left to lose. */
+	base = _map(j, loc.seg, 0);
+	rec = base ? _rec_at(j, base, loc.seg, loc.off) : NULL;
+	if(rec) {
+		__sync_bool_compare_and_swap(&(rec->state), J_APPENDED, J_PENDING);
+	}
+
+	pthread_mutex_unlock(&(j->mutex));
+
+	if(!rec) {
+		errno = ENOENT;
+		return(-1);
+	}
+
+	return(0);
+}
+
+ssize_t journal_take(Journal_t journal, journal_loc_t loc, unsigned char *data) {
+	unsigned char *base;
+	jrec_t *rec;
+	ssize_t size;
+	uint32_t state;
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	/* Only the taker touches the record, the process mutex covers the mapping. */
+	pthread_mutex_lock(&(j->mutex));
+
+	base = _map(j, loc.seg, 0);
+	rec = base ? _rec_at(j, base, loc.seg, loc.off) : NULL;
+	state = rec ? rec->state : J_FREE;
+
+	/* Another process may hold a copy of the same location, only one of them gets it. */
+	if((state != J_PENDING && state != J_APPENDED) || !__sync_bool_compare_and_swap(&(rec->state), state, J_DONE)) {
+		pthread_mutex_unlock(&(j->mutex));
+		errno = ENOENT;
+		return(-1);
+	}
+
+	/* Still counted as live, so the segment can't be recycled under us. */
+	size = rec->size;
+	if(data) {
+		memcpy(data, rec->data, size);
+	}
+
+	if(!__sync_sub_and_fetch(&(((jseg_t *)base)->live), 1)) {
+		flock(j->ctl_fd, LOCK_EX);
+		_advance_head(j);
+		flock(j->ctl_fd, LOCK_UN);
+	}
+
+	pthread_mutex_unlock(&(j->mutex));
+
+	return(size);
+}
+
+/* Lists live records, or only the uncommitted ones. */
+static ssize_t _list(journal_t *j, journal_pending_t **pending, int uncommitted) {
+	size_t count = 0;
+	size_t room = 0;
+	journal_pending_t *list = NULL;
+	uint32_t seg;
+
+	_lock(j);
+
+	for(seg = j->ctl->head; seg <= j->ctl->tail; ++seg) {
+		unsigned char *base = _map(j, seg, 0);
+		uint64_t off = sizeof(jseg_t);
+		jrec_t *rec;
+
+		if(!base) {
+			continue;
+		}
+
+		while((rec = _rec_at(j, base, seg, off)) && rec->state != J_END) {
+			if(rec->state == J_APPENDED || (rec->state == J_PENDING && !uncommitted)) {
+				if(count == room) {
+					journal_pending_t *bigger;
+
+					room = room ? room * 2 : 64;
+					bigger = realloc(list, room * sizeof(*list));
+					if(!bigger) {
+						_unlock(j);
+						free(list);
+						return(-1);
+					}
+					list = bigger;
+				}
+
+				list[count].loc.seg = seg;
+				list[count].loc.off = off;
+				list[count].prio = rec->prio;
+				count++;
+			}
+			off += _rec_len(rec->size);
+		}
+	}
+
+	_unlock(j);
+
+	*pending = list;
+
+	return(count);
+}
+
+ssize_t journal_pending(Journal_t journal, journal_pending_t **pending) {
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	return(_list(j, pending, 0));
+}
+
+ssize_t journal_uncommitted(Journal_t journal, journal_pending_t **pending) {
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	return(_list(j, pending, 1));
+}
+
+int journal_sync(Journal_t journal) {
+	unsigned int x;
+	journal_t *j = (journal_t*)journal;
+
+	if(!j || j->magic != JOURNAL_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	_lock(j);
+
+	_sync_locked(j);
+
+	/* Retirements too, so they aren't seen again after a crash. */
+	for(x = 0; x < JOURNAL_MAP_SLOTS; ++x) {
+		if(j->maps[x].base) {
+			msync(j->maps[x].base, j->segment_size, MS_SYNC);
+		}
+	}
+
+	_unlock(j);
+
+	return(0);
+}
@@ -0,0 +1,149 @@
+/*
+ * journal.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#ifndef JOURNAL_H
+#define JOURNAL_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Opaque handle to a journal object. */
+typedef void * Journal_t;
+
+/** Where a record lives in the journal. */
+typedef struct {
+	uint32_t seg; /**< Segment number. */
+	uint32_t off; /**< Offset of the record in the segment. */
+} journal_loc_t;
+
+/** A record still waiting to be taken, see journal_pending(). */
+typedef struct {
+	journal_loc_t loc;
+	long prio;
+} journal_pending_t;
+
+/**
+ * @brief Open a journal, creating it if the directory holds none.
+ *
+ * The journal is a set of fixed size segment files mapped into memory
+ * and appended to in order, plus a control file. Any number of
+ * processes can have the same journal open.
+ *
+ * Recovery rescans the segments for the real end of the log and
+ * rebuilds the record counts. Only ask for it when nobody else has
+ * the journal open.
+ *
+ * @param dir an existing directory for the journal files
+ * @param segment_size bytes per segment, only used when creating the journal
+ * @param sync_every flush after this many appends
+ * @param sync_interval_ns or once the oldest unflushed append is this old, appends or not; 0 for no time limit
+ * @param recover nonzero to rescan the journal after a crash
+ *
+ * return a journal object, or NULL on failure (errno is set)
+ */
+Journal_t journal_open(const char *dir, size_t segment_size, unsigned int sync_every, uint64_t sync_interval_ns, int recover);
+
+/**
+ * @brief Flush and close a journal object.
+ *
+ * Records not yet taken stay in the journal files.
+ *
+ * @param journal the journal to close
+ */
+void journal_close(Journal_t journal);
+
+/**
+ * @brief Append a record.
+ *
+ * The record is durable once the batch it belongs to is flushed. It
+ * stays uncommitted until journal_commit(), see journal_uncommitted().
+ *
+ * @param journal the journal
+ * @param prio the record priority
+ * @param data the record payload
+ * @param size the payload size
+ * @param loc filled in with the record location
+ *
+ * return zero on success, anything else is failure
+ */
+int journal_append(Journal_t journal, long prio, const unsigned char *data, size_t size, journal_loc_t *loc);
+
+/**
+ * @brief Commit a record once it has been handed off.
+ *
+ * A record that was taken already is left alone.
+ *
+ * @param journal the journal
+ * @param loc the record location
+ *
+ * return zero on success, anything else is failure
+ */
+int journal_commit(Journal_t journal, journal_loc_t loc);
+
+/**
+ * @brief Copy a record out and retire it.
+ *
+ * Segments are recycled once every record in them has been taken.
+ * Committed or not, a record can only be taken once.
+ *
+ * @param journal the journal
+ * @param loc the record location
+ * @param data filled in with the record payload, or NULL to just retire it
+ *
+ * return the payload size, -1 if there is no such pending record
+ */
+ssize_t journal_take(Journal_t journal, journal_loc_t loc, unsigned char *data);
+
+/**
+ * @brief List the records that haven't been taken.
+ *
+ * @param journal the journal
+ * @param pending filled in with an array the caller must free()
+ *
+ * return the number of records, -1 on error
+ */
+ssize_t journal_pending(Journal_t journal, journal_pending_t **pending);
+
+/**
+ * @brief List the records that were appended but never committed.
+ *
+ * Besides appends still in progress, these are the records whose
+ * writer died before it could hand them off.
+ *
+ * @param journal the journal
+ * @param pending filled in with an array the caller must free()
+ *
+ * return the number of records, -1 on error
+ */
+ssize_t journal_uncommitted(Journal_t journal, journal_pending_t **pending);
+
+/**
+ * @brief Flush everything written to the journal so far.
+ *
+ * @param journal the journal
+ *
+ * return zero on success, anything else is failure
+ */
+int journal_sync(Journal_t journal);
+
+#endif /* JOURNAL_H */
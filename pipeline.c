@@ -0,0 +1,546 @@
+/*
+ * pipeline.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Every stage is a plain thread pool whose function takes one payload
+ * from the stage's input ring, runs the stage function on it and puts
+ * the result on the next stage's ring. The rings only hold pointers,
+ * so payloads are never copied between stages. They are bounded, so a
+ * slow stage pushes back on the ones in front of it instead of letting
+ * memory grow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pipeline.h"
+
+#define PIPELINE_MAGIC (0x50697065)
+#define PIPELINE_MAGIC_DELETED (0x44656164)
+
+/* Bounded ring of payload pointers in front of a stage. */
+typedef struct pl_ring_t
+{
+   pthread_mutex_t lock;
+   pthread_cond_t not_empty;
+   pthread_cond_t not_full;
+   pthread_cond_t drained;
+   void **slots;
+   unsigned int capacity;
+   unsigned int head;
+   unsigned int count;
+   unsigned int max_count;
+   unsigned int active;
+   unsigned int closed;
+   /* Stats live under the ring lock, which is taken around every call anyway. */
+   unsigned long processed;
+   uint64_t busy_ns;
+} pl_ring_t;
+
+typedef struct pl_stage_t
+{
+   PipelineStage_t run_function;
+   void *arg;
+   unsigned int num_workers;
+   ThreadPool_t pool;
+   pl_ring_t in;
+   struct pl_stage_t *next;
+} pl_stage_t;
+
+/* Internal only pipeline type. */
+typedef struct pipeline_t
+{
+   unsigned int magic;
+   pthread_mutex_t pipeline_lock;
+   unsigned int queue_depth;
+   unsigned int started;
+   unsigned int num_stages;
+   pl_stage_t **stages;
+} pipeline_t;
+
+static uint64_t _now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int _ring_init(pl_ring_t *ring, unsigned int capacity)
+{
+   ring->slots = calloc(capacity, sizeof(*ring->slots));
+   if(!ring->slots) {
+      return(-1);
+   }
+   ring->capacity = capacity;
+
+   pthread_mutex_init(&ring->lock, NULL);
+   pthread_cond_init(&ring->not_empty, NULL);
+   pthread_cond_init(&ring->not_full, NULL);
+   pthread_cond_init(&ring->drained, NULL);
+
+   return(0);
+}
+
+static void _ring_destroy(pl_ring_t *ring)
+{
+   pthread_cond_destroy(&ring->drained);
+   pthread_cond_destroy(&ring->not_full);
+   pthread_cond_destroy(&ring->not_empty);
+   pthread_mutex_destroy(&ring->lock);
+   free(ring->slots);
+}
+
+static int _ring_push(pl_ring_t *ring, void *payload)
+{
+   pthread_mutex_lock(&ring->lock);
+
+   while(!ring->closed && ring->count == ring->capacity) {
+      pthread_cond_wait(&ring->not_full, &ring->lock);
+   }
+
+   if(ring->closed) {
+      pthread_mutex_unlock(&ring->lock);
+      errno = EPIPE;
+      return(-1);
+   }
+
+   ring->slots[(ring->head + ring->count) % ring->capacity] = payload;
+   ring->count++;
+   if(ring->count > ring->max_count) {
+      ring->max_count = ring->count;
+   }
+
+   pthread_cond_signal(&ring->not_empty);
+   pthread_mutex_unlock(&ring->lock);
+
+   return(0);
+}
+
+/* Returns NULL once the ring is closed and empty. The caller counts as
+ * active until it calls _ring_finish().
+ */
+static void *_ring_pop(pl_ring_t *ring)
+{
+   void *payload;
+
+   pthread_mutex_lock(&ring->lock);
+
+   while(!ring->closed && !ring->count) {
+      pthread_cond_wait(&ring->not_empty, &ring->lock);
+   }
+
+   if(!ring->count) {
+      pthread_mutex_unlock(&ring->lock);
+      return(NULL);
+   }
+
+   payload = ring->slots[ring->head];
+   ring->head = (ring->head + 1) % ring->capacity;
+   ring->count--;
+   ring->active++;
+
+   pthread_cond_signal(&ring->not_full);
+   pthread_mutex_unlock(&ring->lock);
+
+   return(payload);
+}
+
+static void _ring_finish(pl_ring_t *ring, uint64_t busy_ns)
+{
+   pthread_mutex_lock(&ring->lock);
+
+   ring->active--;
+   ring->processed++;
+   ring->busy_ns += busy_ns;
+
+   if(ring->closed && !ring->count && !ring->active) {
+      pthread_cond_broadcast(&ring->drained);
+   }
+
+   pthread_mutex_unlock(&ring->lock);
+}
+
+/* Stop the workers of a stage that never got any payloads, see pipeline_start(). */
+static void _ring_close(pl_ring_t *ring)
+{
+   pthread_mutex_lock(&ring->lock);
+   ring->closed = 1;
+   pthread_cond_broadcast(&ring->not_empty);
+   pthread_mutex_unlock(&ring->lock);
+}
+
+static void _ring_reopen(pl_ring_t *ring)
+{
+   pthread_mutex_lock(&ring->lock);
+   ring->closed = 0;
+   pthread_mutex_unlock(&ring->lock);
+}
+
+/* Close the ring to new payloads and wait until everything on it went through the stage. */
+static void _ring_drain(pl_ring_t *ring)
+{
+   pthread_mutex_lock(&ring->lock);
+
+   ring->closed = 1;
+   pthread_cond_broadcast(&ring->not_empty);
+   pthread_cond_broadcast(&ring->not_full);
+
+   while(ring->count || ring->active) {
+      pthread_cond_wait(&ring->drained, &ring->lock);
+   }
+
+   pthread_mutex_unlock(&ring->lock);
+}
+
+/* Thread pool function: handles one payload and returns. */
+static void *_stage_worker(void *arg)
+{
+   pl_stage_t *stage = (pl_stage_t*)arg;
+   void *payload;
+   uint64_t start;
+   uint64_t busy_ns;
+
+   payload = _ring_pop(&stage->in);
+   if(!payload) {
+      /* Stage is shutting down, the pool delete is on its way. */
+      sched_yield();
+      return(NULL);
+   }
+
+   start = _now_ns();
+   payload = stage->run_function(payload, stage->arg);
+   busy_ns = _now_ns() - start;
+
+   /* The payload is moved before the stage stops counting as active, so
+    * a drained stage never has anything left in flight. Time blocked on
+    * a full ring isn't busy time, that belongs to the stage behind it.
+    */
+   if(payload && stage->next) {
+      _ring_push(&stage->next->in, payload);
+   }
+
+   _ring_finish(&stage->in, busy_ns);
+
+   return(NULL);
+}
+
+Pipeline_t pipeline_create(unsigned int queue_depth)
+{
+   pipeline_t *_pipeline;
+
+   if(!queue_depth) {
+      errno = EINVAL;
+      return(0);
+   }
+
+   _pipeline = calloc(1, sizeof(*_pipeline));
+   if(!_pipeline) {
+      /* calloc() sets errno for us */
+      return(0);
+   }
+
+   _pipeline->magic = PIPELINE_MAGIC;
+   _pipeline->queue_depth = queue_depth;
+   pthread_mutex_init(&_pipeline->pipeline_lock, NULL);
+
+   return(_pipeline);
+}
+
+int pipeline_add_stage(Pipeline_t pipeline, PipelineStage_t stage_function, void *arg, unsigned int num_workers)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+   pl_stage_t **stages;
+   pl_stage_t *stage;
+   int index;
+
+   if(!stage_function || !num_workers) {
+      errno = EINVAL;
+      return(-1);
+   }
+
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+
+   if(_pipeline->magic != PIPELINE_MAGIC || _pipeline->started) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      errno = EBUSY;
+      return(-1);
+   }
+
+   stage = calloc(1, sizeof(*stage));
+   if(!stage) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      return(-1);
+   }
+
+   if(_ring_init(&stage->in, _pipeline->queue_depth)) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      free(stage);
+      return(-1);
+   }
+
+   stages = realloc(_pipeline->stages, (_pipeline->num_stages + 1) * sizeof(*stages));
+   if(!stages) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      _ring_destroy(&stage->in);
+      free(stage);
+      return(-1);
+   }
+   _pipeline->stages = stages;
+
+   stage->run_function = stage_function;
+   stage->arg = arg;
+   stage->num_workers = num_workers;
+
+   index = _pipeline->num_stages++;
+   stages[index] = stage;
+   if(index) {
+      stages[index - 1]->next = stage;
+   }
+
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   return(index);
+}
+
+BOOLEAN pipeline_start(Pipeline_t pipeline)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+   unsigned int x;
+
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+
+   if(_pipeline->magic != PIPELINE_MAGIC || _pipeline->started || !_pipeline->num_stages) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      return(BOOLEAN_FALSE);
+   }
+
+   /* Back to front, so a started stage never pushes into one without threads. */
+   for(x = _pipeline->num_stages; x > 0; --x) {
+      pl_stage_t *stage = _pipeline->stages[x - 1];
+
+      stage->pool = thread_pool_create(stage->num_workers, _stage_worker, stage);
+      if(!stage->pool) {
+         break;
+      }
+   }
+
+   if(x) {
+      /* Nothing was pushed yet, so the stages behind are idle on empty
+       * rings. Stop them, and leave the pipeline as it was for a retry.
+       */
+      for( ; x < _pipeline->num_stages; ++x) {
+         pl_stage_t *stage = _pipeline->stages[x];
+
+         _ring_close(&stage->in);
+         thread_pool_delete(stage->pool);
+         stage->pool = NULL;
+         _ring_reopen(&stage->in);
+      }
+
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      return(BOOLEAN_FALSE);
+   }
+
+   _pipeline->started = 1;
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   return(BOOLEAN_TRUE);
+}
+
+int pipeline_push(Pipeline_t pipeline, void *payload)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+
+   if(!_pipeline || _pipeline->magic != PIPELINE_MAGIC || !_pipeline->num_stages) {
+      errno = ENODEV;
+      return(-1);
+   }
+
+   if(!payload) {
+      errno = EINVAL;
+      return(-1);
+   }
+
+   /* Nothing would ever take it off the ring. */
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+   if(!_pipeline->started) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      errno = EINVAL;
+      return(-1);
+   }
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   return(_ring_push(&_pipeline->stages[0]->in, payload));
+}
+
+int pipeline_rebalance(Pipeline_t pipeline, unsigned int max_workers)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+   pl_stage_t *bottleneck = NULL;
+   pl_stage_t *idle = NULL;
+   uint64_t bottleneck_load = 0;
+   uint64_t idle_load = 0;
+   unsigned int total = 0;
+   unsigned long processed = 0;
+   unsigned int x;
+   int grown = -1;
+
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+
+   if(_pipeline->magic != PIPELINE_MAGIC || !_pipeline->started) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      return(-1);
+   }
+
+   /* A full ring only says the stage is stuck behind something: a slow
+    * stage backs up every ring in front of it. What each worker costs is
+    * the average time in the stage function divided over the workers,
+    * and the stage with the highest cost that has work waiting is the
+    * bottleneck.
+    */
+   for(x = 0; x < _pipeline->num_stages; ++x) {
+      pl_stage_t *stage = _pipeline->stages[x];
+      unsigned int depth;
+      uint64_t load = 0;
+
+      pthread_mutex_lock(&stage->in.lock);
+      depth = stage->in.count;
+      if(stage->in.processed) {
+         load = stage->in.busy_ns / stage->in.processed / stage->num_workers;
+      }
+      processed += stage->in.processed;
+      pthread_mutex_unlock(&stage->in.lock);
+
+      total += stage->num_workers;
+
+      if(depth && (!bottleneck || load > bottleneck_load)) {
+         bottleneck = stage;
+         bottleneck_load = load;
+         grown = x;
+      }
+
+      /* Never take a stage's last worker. */
+      if(stage->num_workers > 1 && (!idle || load < idle_load)) {
+         idle = stage;
+         idle_load = load;
+      }
+   }
+
+   /* No timings yet, any choice would be a guess. */
+   if(!bottleneck || !processed) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      return(-1);
+   }
+
+   if(total >= max_workers) {
+      /* Moving a worker only helps if it comes from a cheaper stage. */
+      if(!idle || idle == bottleneck || idle_load >= bottleneck_load) {
+         pthread_mutex_unlock(&_pipeline->pipeline_lock);
+         return(-1);
+      }
+
+      /* The trimmed worker leaves after its next payload. */
+      thread_pool_trim(idle->pool, 1);
+      idle->num_workers--;
+   }
+
+   if(thread_pool_add(bottleneck->pool, 1, NULL) == BOOLEAN_TRUE) {
+      bottleneck->num_workers++;
+   } else {
+      grown = -1;
+   }
+
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   return(grown);
+}
+
+int pipeline_get_stats(Pipeline_t pipeline, unsigned int stage, pipeline_stage_stats_t *stats)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+   pl_stage_t *_stage;
+
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+
+   if(_pipeline->magic != PIPELINE_MAGIC || stage >= _pipeline->num_stages) {
+      pthread_mutex_unlock(&_pipeline->pipeline_lock);
+      errno = EINVAL;
+      return(-1);
+   }
+
+   _stage = _pipeline->stages[stage];
+   stats->workers = _stage->num_workers;
+
+   pthread_mutex_lock(&_stage->in.lock);
+   stats->processed = _stage->in.processed;
+   stats->busy_ns = _stage->in.busy_ns;
+   stats->depth = _stage->in.count;
+   stats->max_depth = _stage->in.max_count;
+   stats->active = _stage->in.active;
+   pthread_mutex_unlock(&_stage->in.lock);
+
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   return(0);
+}
+
+void pipeline_delete(Pipeline_t pipeline)
+{
+   pipeline_t *_pipeline = (pipeline_t*)pipeline;
+   unsigned int x;
+
+   if(!_pipeline) {
+      return;
+   }
+
+   if(_pipeline->magic != PIPELINE_MAGIC) {
+      /* Already deleted? Not a pipeline? Bail out. */
+      return;
+   }
+
+   pthread_mutex_lock(&_pipeline->pipeline_lock);
+   _pipeline->magic = PIPELINE_MAGIC_DELETED;
+   pthread_mutex_unlock(&_pipeline->pipeline_lock);
+
+   /* Front to back: once a stage is drained nothing can reach the next one's ring but what's already there. */
+   for(x = 0; x < _pipeline->num_stages; ++x) {
+      pl_stage_t *stage = _pipeline->stages[x];
+
+      if(stage->pool) {
+         _ring_drain(&stage->in);
+         thread_pool_delete(stage->pool);
+      }
+   }
+
+   for(x = 0; x < _pipeline->num_stages; ++x) {
+      _ring_destroy(&_pipeline->stages[x]->in);
+      free(_pipeline->stages[x]);
+   }
+
+   pthread_mutex_destroy(&_pipeline->pipeline_lock);
+   free(_pipeline->stages);
+   free(_pipeline);
+}
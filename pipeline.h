@@ -0,0 +1,138 @@
+/*
+ * pipeline.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#ifndef PIPELINE_H
+#define PIPELINE_H 1
+
+#include <stdint.h>
+
+#include "thread_pool.h"
+
+/** Opaque type representing a pipeline of thread pools. */
+typedef void *Pipeline_t;
+
+/**
+ * Stage function type.
+ *
+ * Called with one payload from the stage's input queue. The returned
+ * pointer is handed to the next stage; return NULL to drop the payload.
+ * The last stage's return value is ignored, so it should dispose of the
+ * payload itself.
+ */
+typedef void *(*PipelineStage_t)(void *payload, void *arg);
+
+/** Per-stage statistics. */
+typedef struct {
+   unsigned long processed; /**< Payloads that went through the stage function. */
+   uint64_t busy_ns; /**< Total time spent in the stage function, summed over all workers. */
+   unsigned int depth; /**< Payloads waiting in the stage's input queue. */
+   unsigned int max_depth; /**< High water mark of the input queue. */
+   unsigned int active; /**< Workers currently in the stage function. */
+   unsigned int workers; /**< Workers the stage is sized to. */
+} pipeline_stage_stats_t;
+
+/**
+ * @brief Create an empty pipeline.
+ *
+ * @param queue_depth capacity of the queue in front of each stage
+ *
+ * return a pipeline object, or NULL on failure (errno is set)
+ */
+Pipeline_t pipeline_create(unsigned int queue_depth);
+
+/**
+ * @brief Append a stage to the pipeline.
+ *
+ * Stages can only be added before pipeline_start().
+ *
+ * @param pipeline the pipeline object
+ * @param stage_function the stage function
+ * @param arg the stage function argument
+ * @param num_workers number of threads running the stage
+ *
+ * return the stage number, or -1 on failure (errno is set)
+ */
+int pipeline_add_stage(Pipeline_t pipeline, PipelineStage_t stage_function, void *arg, unsigned int num_workers);
+
+/**
+ * @brief Spawn the thread pools for all stages.
+ *
+ * On failure no stage is left running, and the call can be retried.
+ *
+ * @param pipeline the pipeline object
+ *
+ * return BOOLEAN_TRUE on success, BOOLEAN_FALSE on failure
+ */
+BOOLEAN pipeline_start(Pipeline_t pipeline);
+
+/**
+ * @brief Feed a payload to the first stage.
+ *
+ * The payload is passed by pointer and never copied. Blocks while the
+ * first stage's queue is full. Fails with EINVAL before pipeline_start().
+ *
+ * @param pipeline the pipeline object
+ * @param payload the payload, must not be NULL
+ *
+ * return zero on success, anything else is failure
+ */
+int pipeline_push(Pipeline_t pipeline, void *payload);
+
+/**
+ * @brief Move workers towards the bottleneck stage.
+ *
+ * The stage with work queued and the highest time per payload per
+ * worker gets another worker. Once the pipeline holds max_workers
+ * threads, the worker is taken from the cheapest stage instead. Call it
+ * periodically, each call moves at most one worker. Nothing moves until
+ * some stage has processed a payload.
+ *
+ * @param pipeline the pipeline object
+ * @param max_workers upper limit on the threads of all stages combined
+ *
+ * return the stage that grew, or -1 if nothing changed
+ */
+int pipeline_rebalance(Pipeline_t pipeline, unsigned int max_workers);
+
+/**
+ * @brief Get a stage's statistics.
+ *
+ * @param pipeline the pipeline object
+ * @param stage the stage number returned by pipeline_add_stage()
+ * @param stats filled in with the statistics
+ *
+ * return zero on success, anything else is failure
+ */
+int pipeline_get_stats(Pipeline_t pipeline, unsigned int stage, pipeline_stage_stats_t *stats);
+
+/**
+ * @brief Delete a pipeline object.
+ *
+ * Stages are shut down in order, each one only after everything queued
+ * in front of it has been processed. Will block until then.
+ *
+ * @param pipeline the pipeline to delete
+ */
+void pipeline_delete(Pipeline_t pipeline);
+
+#endif // PIPELINE_H
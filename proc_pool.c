@@ -0,0 +1,407 @@
+
+/*
+ * proc_pool.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Processes can't share the thread pool's counters, so trims go through
+ * a small shared mapping: the parent posts how many processes should
+ * leave, and each child claims one of those cuts with a compare and swap
+ * after its run function returns. A child that dies without claiming a
+ * cut is replaced, whatever the reason it went away.
+ *
+ * All children are forked by the supervisor thread, which also reaps
+ * them. That way PR_SET_PDEATHSIG, which fires when the forking thread
+ * exits, means the pool went away rather than some caller's thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif /* __linux__ */
+
+#include "proc_pool.h"
+
+#define PROC_POOL_MAGIC (0x50726f63)
+#define PROC_POOL_MAGIC_DELETED (0x46726565)
+
+/* How often the supervisor looks for dead children. */
+#define PROC_POOL_SUPERVISE_NS (50 * 1000 * 1000ULL)
+
+/* Internal only, mapped into the parent and every child. */
+typedef struct proc_pool_shared_t
+{
+   pid_t parent;
+   unsigned int to_cut;
+} proc_pool_shared_t;
+
+/* Internal only pool type. */
+typedef struct proc_pool_t
+{
+   unsigned int magic;
+   pthread_mutex_t pool_lock;
+   pthread_cond_t pool_cond;
+   pthread_cond_t done_cond;
+   unsigned int desired_procs;
+   pid_t *pids;
+   unsigned int num_pids;
+   unsigned int max_pids;
+   unsigned long spawn_requests;
+   unsigned long spawn_done;
+   BOOLEAN spawn_rv;
+   unsigned int stopping;
+   pthread_t supervisor;
+   proc_pool_shared_t *shared;
+   Thread_t run_function;
+   void *arg;
+} proc_pool_t;
+
+static void _child_main(proc_pool_shared_t *shared, Thread_t function, void *arg)
+{
+   unsigned int cut;
+
+#ifdef __linux__
+   prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif /* __linux__ */
+
+   /* The parent may have gone before the death signal was armed. */
+   if(getppid() != shared->parent) {
+      _exit(0);
+   }
+
+   while(1) {
+      function(arg);
+
+      while((cut = shared->to_cut)) {
+         if(__sync_bool_compare_and_swap(&shared->to_cut, cut, cut - 1)) {
+            _exit(0);
+         }
+      }
+
+      if(getppid() != shared->parent) {
+         _exit(0);
+      }
+   }
+}
+
+/* WARNING: Only called from locked context.
+ * Live children that aren't on their way out.
+ */
+static unsigned int _effective_from_locked_context(proc_pool_t *_pool)
+{
+   unsigned int cut = _pool->shared->to_cut;
+
+   return(_pool->num_pids > cut ? _pool->num_pids - cut : 0);
+}
+
+/* WARNING: Only called from locked context, in the supervisor. */
+static BOOLEAN _spawn_missing_from_locked_context(proc_pool_t *_pool)
+{
+   pid_t pid;
+
+   while(_effective_from_locked_context(_pool) < _pool->desired_procs) {
+      if(_pool->num_pids == _pool->max_pids) {
+         unsigned int max_pids = _pool->max_pids ? _pool->max_pids * 2 : 8;
+         pid_t *pids = realloc(_pool->pids, max_pids * sizeof(*pids));
+
+         if(!pids) {
+            return(BOOLEAN_FALSE);
+         }
+         _pool->pids = pids;
+         _pool->max_pids = max_pids;
+      }
+
+      /* Only the parent's buffered output would be printed twice. */
+      fflush(NULL);
+
+      pid = fork();
+      if(pid < 0) {
+         return(BOOLEAN_FALSE);
+      }
+
+      if(!pid) {
+         _child_main(_pool->shared, _pool->run_function, _pool->arg);
+      }
+
+      _pool->pids[_pool->num_pids++] = pid;
+   }
+
+   return(BOOLEAN_TRUE);
+}
+
+/* WARNING: Only called from locked context, in the supervisor. */
+static void _reap_from_locked_context(proc_pool_t *_pool)
+{
+   unsigned int x = 0;
+   unsigned int cut;
+   int status;
+   pid_t rv;
+
+   while(x < _pool->num_pids) {
+      rv = waitpid(_pool->pids[x], &status, WNOHANG);
+
+      if(!rv || (rv < 0 && errno != ECHILD)) {
+         ++x;
+         continue;
+      }
+
+      /* ECHILD: SIGCHLD is ignored and the kernel reaped it, status unknown. */
+      if(rv > 0 && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+         /* A crash during a trim does the trim's work. */
+         while((cut = _pool->shared->to_cut)) {
+            if(__sync_bool_compare_and_swap(&_pool->shared->to_cut, cut, cut - 1)) {
+               break;
+            }
+         }
+      }
+
+      _pool->pids[x] = _pool->pids[--_pool->num_pids];
+   }
+}
+
+static void *_supervise(void *arg)
+{
+   proc_pool_t *_pool = (proc_pool_t*)arg;
+   struct timespec ts;
+   BOOLEAN rv;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   while(!_pool->stopping) {
+      _reap_from_locked_context(_pool);
+
+      /* Fork what was asked for, and replace what went missing. */
+      rv = _spawn_missing_from_locked_context(_pool);
+      if(_pool->spawn_done != _pool->spawn_requests) {
+         if(rv != BOOLEAN_TRUE) {
+            _pool->desired_procs = _effective_from_locked_context(_pool);
+         }
+         _pool->spawn_rv = rv;
+         _pool->spawn_done = _pool->spawn_requests;
+      }
+      pthread_cond_broadcast(&_pool->done_cond);
+
+      if(_pool->spawn_done == _pool->spawn_requests) {
+         clock_gettime(CLOCK_MONOTONIC, &ts);
+         ts.tv_sec += (ts.tv_nsec + PROC_POOL_SUPERVISE_NS) / 1000000000ULL;
+         ts.tv_nsec = (ts.tv_nsec + PROC_POOL_SUPERVISE_NS) % 1000000000ULL;
+         pthread_cond_timedwait(&_pool->pool_cond, &_pool->pool_lock, &ts);
+      }
+   }
+
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(NULL);
+}
+
+/* WARNING: Only called from locked context.
+ * Hands the forking to the supervisor and waits for it.
+ */
+static BOOLEAN _request_spawn_from_locked_context(proc_pool_t *_pool)
+{
+   unsigned long request = ++_pool->spawn_requests;
+
+   pthread_cond_signal(&_pool->pool_cond);
+   while(_pool->spawn_done < request) {
+      pthread_cond_wait(&_pool->done_cond, &_pool->pool_lock);
+   }
+
+   return(_pool->spawn_rv);
+}
+
+ProcPool_t proc_pool_create(int num_procs, Thread_t run_function, void *arg)
+{
+   proc_pool_t *_pool = NULL;
+   pthread_condattr_t attr;
+
+   if(!run_function) {
+      errno = ENODEV;
+      return(0);
+   }
+
+   if(num_procs < 0) {
+      errno = EINVAL;
+      return(0);
+   }
+
+   _pool = calloc(1, sizeof(*_pool));
+   if(!_pool) {
+      /* calloc() sets errno for us */
+      return(0);
+   }
+
+   _pool->shared = mmap(NULL, sizeof(*_pool->shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if(_pool->shared == MAP_FAILED) {
+      /* mmap() sets errno for us */
+      free(_pool);
+      return(0);
+   }
+
+   _pool->magic = PROC_POOL_MAGIC;
+   _pool->shared->parent = getpid();
+   _pool->shared->to_cut = 0;
+   _pool->run_function = run_function;
+   _pool->arg = arg;
+   _pool->desired_procs = num_procs;
+
+   pthread_mutex_init(&_pool->pool_lock, NULL);
+   pthread_cond_init(&_pool->done_cond, NULL);
+
+   /* Supervisor ticks must not jump with the wall clock. */
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&_pool->pool_cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   if(pthread_create(&_pool->supervisor, NULL, _supervise, _pool)) {
+      pthread_mutex_unlock(&_pool->pool_lock);
+      pthread_cond_destroy(&_pool->pool_cond);
+      pthread_cond_destroy(&_pool->done_cond);
+      pthread_mutex_destroy(&_pool->pool_lock);
+      munmap(_pool->shared, sizeof(*_pool->shared));
+      free(_pool);
+      errno = EAGAIN;
+      return(0);
+   }
+
+   _request_spawn_from_locked_context(_pool);
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(_pool);
+}
+
+void proc_pool_delete(ProcPool_t pool)
+{
+   proc_pool_t *_pool = (proc_pool_t*)pool;
+
+   if(!_pool || _pool->magic != PROC_POOL_MAGIC) {
+      /* Already deleted? Not a process pool? Bail out. */
+      return;
+   }
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   /* Every child leaves after its current run. */
+   _pool->magic = PROC_POOL_MAGIC_DELETED;
+   _pool->desired_procs = 0;
+   __sync_lock_test_and_set(&_pool->shared->to_cut, _pool->num_pids);
+   pthread_cond_signal(&_pool->pool_cond);
+
+   while(_pool->num_pids) {
+      pthread_cond_wait(&_pool->done_cond, &_pool->pool_lock);
+   }
+
+   _pool->stopping = 1;
+   pthread_cond_signal(&_pool->pool_cond);
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   pthread_join(_pool->supervisor, NULL);
+
+   munmap(_pool->shared, sizeof(*_pool->shared));
+   free(_pool->pids);
+   pthread_cond_destroy(&_pool->pool_cond);
+   pthread_cond_destroy(&_pool->done_cond);
+   pthread_mutex_destroy(&_pool->pool_lock);
+   free(_pool);
+}
+
+void proc_pool_trim(ProcPool_t pool, unsigned int num_to_cut)
+{
+   proc_pool_t *_pool = (proc_pool_t*)pool;
+   unsigned int effective;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   if(_pool->magic != PROC_POOL_MAGIC) {
+      pthread_mutex_unlock(&_pool->pool_lock);
+      return;
+   }
+
+   /* Safety: Only trim if the size can handle it, otherwise, drop pool to zero. */
+   if(_pool->desired_procs >= num_to_cut) {
+      _pool->desired_procs -= num_to_cut;
+   } else {
+      _pool->desired_procs = 0;
+   }
+
+   effective = _effective_from_locked_context(_pool);
+   if(effective > _pool->desired_procs) {
+      __sync_add_and_fetch(&_pool->shared->to_cut, effective - _pool->desired_procs);
+   }
+
+   pthread_mutex_unlock(&_pool->pool_lock);
+}
+
+BOOLEAN proc_pool_add(ProcPool_t pool, unsigned int num_to_add, void *arg)
+{
+   proc_pool_t *_pool = (proc_pool_t*)pool;
+   unsigned int cut;
+   BOOLEAN rv;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   if(_pool->magic != PROC_POOL_MAGIC) {
+      pthread_mutex_unlock(&_pool->pool_lock);
+      return(BOOLEAN_FALSE);
+   }
+
+   if(arg) {
+      _pool->arg = arg;
+   }
+
+   /* Call off pending cuts, the processes are still there. */
+   while((cut = _pool->shared->to_cut)) {
+      if(__sync_bool_compare_and_swap(&_pool->shared->to_cut, cut, 0)) {
+         break;
+      }
+   }
+
+   _pool->desired_procs = _pool->num_pids + num_to_add;
+   rv = _request_spawn_from_locked_context(_pool);
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(rv);
+}
+
+unsigned int proc_pool_get_pool_size(ProcPool_t pool)
+{
+   unsigned int size = 0;
+   proc_pool_t *_pool = (proc_pool_t*)pool;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+   if(_pool->magic == PROC_POOL_MAGIC) {
+      size = _pool->num_pids;
+   }
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(size);
+}
@@ -0,0 +1,112 @@
+
+/*
+ * proc_pool.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#ifndef PROC_POOL_H
+#define PROC_POOL_H 1
+
+#include "thread_pool.h"
+
+/** Opaque type representing a process pool. */
+typedef void *ProcPool_t;
+
+/**
+ * @brief Create and return a process pool object.
+ *
+ * Forks worker processes that call the run function over and over, the
+ * same way thread pool workers do. Run functions should take one packet
+ * from a keyfile work queue (see workq_init()) and return.
+ *
+ * Each child starts out as a copy of the parent at the time it is
+ * forked. Open the queue in the child, on the first call of the run
+ * function: a queue opened before forking may have its lock held by a
+ * parent thread. Children leave with _exit(), so the parent's atexit()
+ * handlers only run in the parent.
+ *
+ * A supervisor thread in the parent reaps the children and forks a
+ * replacement for any that crash or exit on their own. Children exit if
+ * the parent goes away.
+ *
+ * @param num_procs number of processes in the pool
+ * @param run_function function for each process to run
+ * @param arg argument to each process
+ *
+ * return a process pool object, or NULL on failure (errno is set, EINVAL
+ * for a negative num_procs)
+ */
+ProcPool_t proc_pool_create(int num_procs, Thread_t run_function, void *arg);
+
+/**
+ * @brief Delete a process pool object.
+ *
+ * Will block until all processes have completed their run function and
+ * exited. Destroy the work queue first to get children blocked on it moving.
+ *
+ * @param pool the process pool to delete
+ */
+void proc_pool_delete(ProcPool_t pool);
+
+/**
+ * @brief Trim a process pool's size.
+ *
+ * Processes will exit on completion of the run function until the
+ * desired size is reached. A process that crashes meanwhile counts
+ * towards the trim and isn't replaced.
+ *
+ * Note the pool will not shrink immediately.
+ *
+ * @param pool the pool to trim
+ * @param num_to_cut the number of processes to remove
+ */
+void proc_pool_trim(ProcPool_t pool, unsigned int num_to_cut);
+
+/**
+ * @brief Add processes to a process pool.
+ *
+ * Processes still waiting to leave after a trim are kept first, the
+ * rest are forked immediately.
+ *
+ * If arg is NULL the previous value will be used. Only new processes
+ * see a new value.
+ *
+ * @param pool the pool to be added to
+ * @param num_to_add how many processes to add
+ * @param arg the run function argument
+ *
+ * return BOOLEAN_TRUE on success, BOOLEAN_FALSE on failure
+ */
+BOOLEAN proc_pool_add(ProcPool_t pool, unsigned int num_to_add, void *arg);
+
+/**
+ * @brief Get the number of live processes in the pool.
+ *
+ * Like thread_pool_get_pool_size(), this is greater than the desired
+ * size while a trim is in progress, and briefly lower after a crash.
+ *
+ * @param pool the pool to be queried
+ *
+ * return the number of processes in the pool
+ */
+unsigned int proc_pool_get_pool_size(ProcPool_t pool);
+
+#endif // PROC_POOL_H
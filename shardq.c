@@ -0,0 +1,294 @@
+/*
+ * shardq.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * SysV queues can't hold a message back while another one with the
+ * same key is being worked on, so this one is done in process.
+ *
+ * Each shard is a FIFO of packets. Shards that have packets and are
+ * not owned by a consumer sit on the ready list, which is itself a
+ * FIFO so a busy key can't starve the others. A consumer takes the
+ * shard off the ready list along with its packet, and puts it back
+ * (if it still has packets) in shardq_done().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "shardq.h"
+
+#define SHARDQ_MAGIC (0x53726451)
+
+typedef struct sq_packet_t {
+	struct sq_packet_t *next;
+	long key;
+	size_t size;
+	unsigned char data[];
+} sq_packet_t;
+
+typedef struct sq_shard_t {
+	sq_packet_t *head;
+	sq_packet_t *tail;
+	struct sq_shard_t *ready_next;
+	unsigned int busy;
+} sq_shard_t;
+
+typedef struct sq_t {
+	uint32_t magic;
+	unsigned int num_shards;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready_cond;
+	sq_shard_t *ready_head;
+	sq_shard_t *ready_tail;
+	sq_shard_t shards[];
+} sq_t;
+
+/* Spread sequential keys (session numbers, customer ids) over the shards. */
+static unsigned int _shard_of(const sq_t *q, long key) {
+	uint64_t h = (uint64_t)key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return((unsigned int)(h % q->num_shards));
+}
+
+/* WARNING: Only called with the queue mutex held. */
+static void _make_ready(sq_t *q, sq_shard_t *shard) {
+	shard->ready_next = NULL;
+	if(q->ready_tail) {
+		q->ready_tail->ready_next = shard;
+	} else {
+		q->ready_head = shard;
+	}
+	q->ready_tail = shard;
+
+	pthread_cond_signal(&(q->ready_cond));
+}
+
+ShardQ_t shardq_init(unsigned int num_shards) {
+	sq_t *q;
+
+	if(!num_shards) {
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	q = calloc(1, sizeof(sq_t) + num_shards * sizeof(sq_shard_t));
+	if(!q) {
+		return(NULL);
+	}
+
+	q->magic = SHARDQ_MAGIC;
+	q->num_shards = num_shards;
+
+	pthread_mutex_init(&(q->mutex), NULL);
+	pthread_cond_init(&(q->ready_cond), NULL);
+
+	return((ShardQ_t)q);
+}
+
+int shardq_destroy(ShardQ_t shard_queue) {
+	unsigned int x;
+	sq_t *q = (sq_t*)shard_queue;
+
+	if(!q || q->magic != SHARDQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(q->mutex));
+	q->magic = 0;
+
+	/* Kick out the consumers blocked on the queue. */
+	pthread_cond_broadcast(&(q->ready_cond));
+
+	for(x = 0; x < q->num_shards; ++x) {
+		sq_packet_t *packet = q->shards[x].head;
+
+		while(packet) {
+			sq_packet_t *next = packet->next;
+			free(packet);
+			packet = next;
+		}
+		q->shards[x].head = NULL;
+		q->shards[x].tail = NULL;
+	}
+	q->ready_head = NULL;
+	q->ready_tail = NULL;
+
+	pthread_mutex_unlock(&(q->mutex));
+
+	/* The queue object itself stays, like workq_destroy(). Consumers that
+	 * still own a shard, or loop back into shardq_get(), must find it dead
+	 * rather than freed; there is no telling when the last of them is done.
+	 */
+
+	return(0);
+}
+
+int shardq_add(const unsigned char *buffer, size_t size, ShardQ_t shard_queue, long key) {
+	sq_packet_t *packet;
+	sq_shard_t *shard;
+	sq_t *q = (sq_t*)shard_queue;
+
+	if(!q || q->magic != SHARDQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(size > WORKQ_MAX_SIZE) {
+		errno = ENOSPC;
+		return(-1);
+	}
+
+	/* Only as big as the payload, not a whole workq_msg_t. */
+	packet = malloc(sizeof(*packet) + size);
+	if(!packet) {
+		return(-1);
+	}
+
+	packet->next = NULL;
+	packet->key = key;
+	packet->size = size;
+	memcpy(packet->data, buffer, size);
+
+	pthread_mutex_lock(&(q->mutex));
+
+	if(q->magic != SHARDQ_MAGIC) {
+		pthread_mutex_unlock(&(q->mutex));
+		free(packet);
+		errno = ENODEV;
+		return(-1);
+	}
+
+	shard = &(q->shards[_shard_of(q, key)]);
+
+	if(shard->tail) {
+		shard->tail->next = packet;
+		shard->tail = packet;
+	} else {
+		shard->head = packet;
+		shard->tail = packet;
+
+		/* A busy shard goes back on the ready list in shardq_done(). */
+		if(!shard->busy) {
+			_make_ready(q, shard);
+		}
+	}
+
+	pthread_mutex_unlock(&(q->mutex));
+
+	return(0);
+}
+
+ssize_t shardq_get(ShardQ_t shard_queue, workq_msg_t *msg, unsigned int *shard) {
+	ssize_t size;
+	sq_shard_t *ready;
+	sq_packet_t *packet;
+	sq_t *q = (sq_t*)shard_queue;
+
+	if(!q || q->magic != SHARDQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(q->mutex));
+
+	/* Wait for next ready shard */
+	while(q->magic == SHARDQ_MAGIC && !q->ready_head) {
+		pthread_cond_wait(&(q->ready_cond), &(q->mutex));
+	}
+
+	if(q->magic != SHARDQ_MAGIC) {
+		pthread_mutex_unlock(&(q->mutex));
+		errno = ENODEV;
+		return(-1);
+	}
+
+	ready = q->ready_head;
+	q->ready_head = ready->ready_next;
+	if(!q->ready_head) {
+		q->ready_tail = NULL;
+	}
+	ready->busy = 1;
+
+	packet = ready->head;
+	ready->head = packet->next;
+	if(!ready->head) {
+		ready->tail = NULL;
+	}
+
+	pthread_mutex_unlock(&(q->mutex));
+
+	msg->type = packet->key;
+	memcpy(msg->data, packet->data, packet->size);
+	size = packet->size;
+	*shard = ready - q->shards;
+	free(packet);
+
+	return(size);
+}
+
+int shardq_done(ShardQ_t shard_queue, unsigned int shard) {
+	sq_shard_t *done;
+	sq_t *q = (sq_t*)shard_queue;
+
+	if(!q || q->magic != SHARDQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(shard >= q->num_shards) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(q->mutex));
+
+	if(q->magic != SHARDQ_MAGIC) {
+		pthread_mutex_unlock(&(q->mutex));
+		errno = ENODEV;
+		return(-1);
+	}
+
+	done = &(q->shards[shard]);
+	if(!done->busy) {
+		pthread_mutex_unlock(&(q->mutex));
+		errno = EINVAL;
+		return(-1);
+	}
+
+	done->busy = 0;
+	if(done->head) {
+		_make_ready(q, done);
+	}
+
+	pthread_mutex_unlock(&(q->mutex));
+
+	return(0);
+}
@@ -0,0 +1,105 @@
+/*
+ * shardq.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#ifndef SHARD_QUEUE_H
+#define SHARD_QUEUE_H 1
+
+#include <sys/types.h>
+
+#include "workq.h"
+
+/** Opaque handle to a sharded work queue object. */
+typedef void * ShardQ_t;
+
+/**
+ * @brief Create and initialize a sharded work queue object.
+ *
+ * Packets are hashed by key onto one of the shards. Packets within a
+ * shard are delivered in FIFO order, and a shard is handed to at most
+ * one consumer at a time, so packets with the same key are never
+ * processed concurrently or out of order. Different shards are
+ * consumed in parallel.
+ *
+ * The queue is process private.
+ *
+ * @param num_shards number of shards, should comfortably exceed the number of consumers
+ *
+ * return a sharded work queue object, or NULL on failure (errno is set)
+ */
+ShardQ_t shardq_init(unsigned int num_shards);
+
+/**
+ * @brief Clean up a sharded work queue object.
+ *
+ * Consumers blocked in shardq_get() are woken and fail with ENODEV.
+ * Packets still pending are discarded. The object itself is not freed,
+ * so consumers still holding a shard can call shardq_done() and
+ * shardq_get() safely; both fail with ENODEV.
+ *
+ * @param shard_queue the sharded work queue object to destroy
+ *
+ * return zero on success, something else on error
+ */
+int shardq_destroy(ShardQ_t shard_queue);
+
+/**
+ * @brief Add a work packet to a sharded work queue.
+ *
+ * @param buffer the work queue packet
+ * @param size the size of the work queue packet
+ * @param shard_queue the sharded work queue to add to
+ * @param key the ordering key, packets with equal keys are delivered in order
+ *
+ * return zero on success, anything else is failure
+ */
+int shardq_add(const unsigned char *buffer, size_t size, ShardQ_t shard_queue, long key);
+
+/**
+ * @brief Get a work packet from any ready shard.
+ *
+ * Blocks until a shard that is not owned by another consumer has a
+ * packet. The shard is then owned by the caller until shardq_done()
+ * is called with the returned shard number. The packet's key is
+ * returned in msg->type.
+ *
+ * @param shard_queue the sharded work queue to retrieve from
+ * @param msg object to be filled in with the next work packet
+ * @param shard filled in with the shard the packet came from
+ *
+ * return the size of the work queue packet, -1 on error
+ */
+ssize_t shardq_get(ShardQ_t shard_queue, workq_msg_t *msg, unsigned int *shard);
+
+/**
+ * @brief Release a shard after its packet has been processed.
+ *
+ * The next packet of the shard, if any, becomes available to all consumers.
+ *
+ * @param shard_queue the sharded work queue
+ * @param shard the shard returned by shardq_get()
+ *
+ * return zero on success, anything else is failure
+ */
+int shardq_done(ShardQ_t shard_queue, unsigned int shard);
+
+#endif /* SHARD_QUEUE_H */
@@ -0,0 +1,143 @@
+/*
+ * test_pipeline.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+#define NUM_PAYLOADS (10000)
+
+pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+long sum = 0;
+
+void *decode(void *payload, void *arg) {
+	long *value = (long *)payload;
+
+	*value *= 2;
+	return(value);
+}
+
+/* Deliberately the slow one, so the rebalance has a bottleneck to find. */
+void *transform(void *payload, void *arg) {
+	long *value = (long *)payload;
+
+	usleep(10);
+	*value += 1;
+	return(value);
+}
+
+void *encode(void *payload, void *arg) {
+	long *value = (long *)payload;
+
+	pthread_mutex_lock(&sum_lock);
+	sum += *value;
+	pthread_mutex_unlock(&sum_lock);
+
+	free(value);
+	return(NULL);
+}
+
+int main(void) {
+	Pipeline_t pipeline;
+	pipeline_stage_stats_t stats;
+	long expected = 0;
+	long x;
+	unsigned int stage;
+
+	pipeline = pipeline_create(64);
+	if(!pipeline) {
+		printf("Pipeline could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if(pipeline_add_stage(pipeline, decode, NULL, 1) != 0 ||
+			pipeline_add_stage(pipeline, transform, NULL, 1) != 1 ||
+			pipeline_add_stage(pipeline, encode, NULL, 1) != 2) {
+		printf("Could not add stages: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Nobody would ever take it. */
+	if(pipeline_push(pipeline, &expected) != -1 || errno != EINVAL) {
+		printf("Push before start was accepted.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(pipeline_start(pipeline) != BOOLEAN_TRUE) {
+		printf("Could not start pipeline.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Pushing %d payloads...\n", NUM_PAYLOADS);
+	for(x = 0; x < NUM_PAYLOADS; ++x) {
+		long *value = malloc(sizeof(*value));
+
+		*value = x;
+		expected += x * 2 + 1;
+
+		if(pipeline_push(pipeline, value)) {
+			printf("Error pushing payload: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+
+		if(!(x % 500)) {
+			int grown = pipeline_rebalance(pipeline, 6);
+
+			if(grown >= 0) {
+				printf("Rebalance grew stage %d\n", grown);
+			}
+
+			/* Only the transform stage is slow enough to deserve a worker. */
+			if(grown >= 0 && grown != 1) {
+				printf("Rebalance grew stage %d, expected stage 1.\n", grown);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	printf("Draining pipeline.\n");
+	for(stage = 0; stage < 3; ++stage) {
+		pipeline_get_stats(pipeline, stage, &stats);
+		printf("Stage %u: %u workers, max depth %u\n", stage, stats.workers, stats.max_depth);
+	}
+
+	pipeline_get_stats(pipeline, 1, &stats);
+	if(stats.workers < 2) {
+		printf("The slow stage never got another worker.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pipeline_delete(pipeline);
+
+	if(sum != expected) {
+		printf("Sum %ld, expected %ld\n", sum, expected);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Tests passed.\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,199 @@
+
+/*
+ * test_proc_pool.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+
+#include "workq.h"
+#include "proc_pool.h"
+
+#define WORK_ID (1)
+#define REPLY_ID (2)
+#define NUM_PACKETS (100)
+
+#define CMD_WORK (1)
+#define CMD_CRASH (2)
+
+char keyfile[] = "/tmp/test_proc_pool.XXXXXX";
+WorkQ_t work_queue = NULL;
+WorkQ_t reply_queue = NULL;
+
+void cleanup(void) {
+	workq_destroy(work_queue);
+	workq_destroy(reply_queue);
+	unlink(keyfile);
+}
+
+/* Runs in the children. Queues are opened after the fork, once per child. */
+void *worker(void *arg) {
+	static WorkQ_t work = NULL;
+	static WorkQ_t reply = NULL;
+	workq_msg_t msg;
+	pid_t pid = getpid();
+
+	if(!work) {
+		work = workq_init(keyfile, WORK_ID);
+		reply = workq_init(keyfile, REPLY_ID);
+	}
+
+	if(workq_get(work, &msg) < 0) {
+		/* Queue is gone, the pool is being shut down. */
+		usleep(1000);
+		return(NULL);
+	}
+
+	if(msg.data[0] == CMD_CRASH) {
+		raise(SIGKILL);
+	}
+
+	workq_add((const unsigned char *)&pid, sizeof(pid), reply, 1);
+	return(NULL);
+}
+
+void send_or_die(unsigned char cmd) {
+	if(workq_add(&cmd, sizeof(cmd), work_queue, 1)) {
+		printf("Error adding to the work queue: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Sends work and waits for every reply, returns how many processes answered. */
+int round_trip(int num) {
+	pid_t pids[NUM_PACKETS];
+	int num_pids = 0;
+	workq_msg_t msg;
+	pid_t pid;
+	int x;
+	int y;
+
+	for(x = 0; x < num; ++x) {
+		send_or_die(CMD_WORK);
+	}
+
+	for(x = 0; x < num; ++x) {
+		if(workq_get(reply_queue, &msg) != sizeof(pid)) {
+			printf("Bad reply: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		memcpy(&pid, msg.data, sizeof(pid));
+		for(y = 0; y < num_pids && pids[y] != pid; ++y);
+		if(y == num_pids) {
+			pids[num_pids++] = pid;
+		}
+	}
+
+	return(num_pids);
+}
+
+/* Pool sizes settle as processes finish their runs, give them a few seconds. */
+void wait_for_size(ProcPool_t pool, unsigned int size) {
+	int x;
+
+	for(x = 0; x < 5000 && proc_pool_get_pool_size(pool) != size; ++x) {
+		/* Trimmed processes only leave once they're done with a packet. */
+		if(proc_pool_get_pool_size(pool) > size) {
+			round_trip(1);
+		}
+		usleep(1000);
+	}
+
+	if(proc_pool_get_pool_size(pool) != size) {
+		printf("Pool has %u processes, expected %u.\n", proc_pool_get_pool_size(pool), size);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(void) {
+	ProcPool_t pool;
+	int fd;
+	int x;
+
+	fd = mkstemp(keyfile);
+	if(fd < 0) {
+		printf("Can't create the key file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	work_queue = workq_init(keyfile, WORK_ID);
+	reply_queue = workq_init(keyfile, REPLY_ID);
+	if(!work_queue || !reply_queue) {
+		printf("Can't initialize the work queues.\n");
+		unlink(keyfile);
+		exit(EXIT_FAILURE);
+	}
+
+	atexit(cleanup);
+
+	if(proc_pool_create(-1, worker, NULL) || errno != EINVAL) {
+		printf("Negative pool size was accepted.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Forking 3 worker processes...\n");
+	pool = proc_pool_create(3, worker, NULL);
+	if(!pool || proc_pool_get_pool_size(pool) != 3) {
+		printf("Process pool could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	x = round_trip(NUM_PACKETS);
+	printf("%d packets answered by %d processes.\n", NUM_PACKETS, x);
+
+	printf("Crashing a worker...\n");
+	send_or_die(CMD_CRASH);
+	/* Replaced within a supervisor tick, and the pool keeps working meanwhile. */
+	x = round_trip(NUM_PACKETS);
+	wait_for_size(pool, 3);
+	printf("%d packets answered by %d processes after the crash.\n", NUM_PACKETS, x);
+
+	printf("Growing to 5 processes...\n");
+	if(proc_pool_add(pool, 2, NULL) != BOOLEAN_TRUE || proc_pool_get_pool_size(pool) != 5) {
+		printf("Pool did not grow.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Trimming to 2 processes...\n");
+	proc_pool_trim(pool, 3);
+	wait_for_size(pool, 2);
+
+	/* Trimmed processes leave for good, they are not replaced. */
+	usleep(200000);
+	if(proc_pool_get_pool_size(pool) != 2 || round_trip(NUM_PACKETS) > 2) {
+		printf("Trimmed processes came back.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Waiting on process pool to die.\n");
+	/* Destroying the queue wakes the processes blocked on it. */
+	workq_destroy(work_queue);
+	proc_pool_delete(pool);
+
+	printf("Tests passed.\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,137 @@
+/*
+ * test_shardq.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "shardq.h"
+
+#define NUM_KEYS (16)
+#define NUM_PER_KEY (1000)
+#define NUM_CONSUMERS (4)
+
+ShardQ_t shard_queue = NULL;
+
+pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+int next_expected[NUM_KEYS];
+int in_flight[NUM_KEYS];
+int total = 0;
+
+void *consume(void *arg) {
+	workq_msg_t msg;
+	unsigned int shard;
+	int seq;
+
+	while(shardq_get(shard_queue, &msg, &shard) > 0) {
+		memcpy(&seq, msg.data, sizeof(seq));
+
+		pthread_mutex_lock(&check_lock);
+		if(in_flight[msg.type]++) {
+			printf("Key %ld is being processed twice at once!\n", msg.type);
+			exit(EXIT_FAILURE);
+		}
+		if(seq != next_expected[msg.type]) {
+			printf("Key %ld out of order: got %d, expected %d\n", msg.type, seq, next_expected[msg.type]);
+			exit(EXIT_FAILURE);
+		}
+		next_expected[msg.type]++;
+		pthread_mutex_unlock(&check_lock);
+
+		sched_yield();
+
+		pthread_mutex_lock(&check_lock);
+		in_flight[msg.type]--;
+		total++;
+		pthread_mutex_unlock(&check_lock);
+
+		if(shardq_done(shard_queue, shard) && errno != ENODEV) {
+			printf("shardq_done() failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(errno != ENODEV) {
+		printf("shardq_get() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return(NULL);
+}
+
+int main(void) {
+	pthread_t consumers[NUM_CONSUMERS];
+	int x;
+	int seq;
+	int done = 0;
+	workq_msg_t msg;
+	unsigned int shard;
+
+	shard_queue = shardq_init(8);
+
+	if(!shard_queue) {
+		printf("Failed to initialize a sharded work queue: error %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Starting %d consumers...\n", NUM_CONSUMERS);
+	for(x = 0; x < NUM_CONSUMERS; ++x) {
+		pthread_create(&consumers[x], NULL, consume, NULL);
+	}
+
+	printf("Adding %d packets on each of %d keys...\n", NUM_PER_KEY, NUM_KEYS);
+	for(seq = 0; seq < NUM_PER_KEY; ++seq) {
+		for(x = 0; x < NUM_KEYS; ++x) {
+			if(shardq_add((const unsigned char *)&seq, sizeof(seq), shard_queue, x)) {
+				printf("Error adding to queue: %s (%d)\n", strerror(errno), errno);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	while(!done) {
+		pthread_mutex_lock(&check_lock);
+		done = (total == NUM_KEYS * NUM_PER_KEY);
+		pthread_mutex_unlock(&check_lock);
+		sched_yield();
+	}
+
+	printf("All packets consumed in order, shutting down.\n");
+	shardq_destroy(shard_queue);
+
+	/* Consumers may still own a shard here; the dead queue stays valid for them. */
+	for(x = 0; x < NUM_CONSUMERS; ++x) {
+		pthread_join(consumers[x], NULL);
+	}
+
+	if(shardq_get(shard_queue, &msg, &shard) != -1 || errno != ENODEV ||
+			shardq_done(shard_queue, 0) != -1 || errno != ENODEV) {
+		printf("Destroyed queue still in use.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Tests passed.\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -36,6 +36,9 @@
 	} \
 	printf("Added \"%s\"\tto queue %p priority %d\n", _s, _q, _p)
 
+#define NUM_SMALL_THREADS (200)
+#define SMALL_STACK (64 * 1024)
+
 WorkQ_t work_queue;
 
 const char *one = "One";
@@ -54,21 +57,47 @@ void kill_q(void) {
 	workq_destroy(work_queue);
 }
 
+/* Works through one packet and returns, the pool runs it again. */
 void *print_msg(void *arg) {
 	workq_msg_t msg;
-	printf("Hello from thread %ld\n", pthread_self());
-	while(1) {
-		printf("Thread %ld trying to get a message...\n", pthread_self());
-		workq_get(work_queue, &msg);
-		printf("Thread %ld: Got message \"%s\" priority %ld\n", pthread_self(), msg.data, msg.type);
+	printf("Thread %ld trying to get a message...\n", pthread_self());
+	if(workq_get(work_queue, &msg) < 0) {
+		/* Queue is gone, the pool is being shut down. */
+		sched_yield();
+		return(NULL);
 	}
+	printf("Thread %ld: Got message \"%s\" priority %ld\n", pthread_self(), msg.data, msg.type);
+	return(NULL);
+}
+
+void *idle(void *arg) {
+	usleep(1000);
+	return(NULL);
+}
+
+/* Default group function once swapped in, arg is the counter. */
+void *count_runs(void *arg) {
+	__sync_add_and_fetch((unsigned long *)arg, 1);
+	usleep(1000);
+	return(NULL);
+}
+
+/* Queue fed group, gets the packet with the group argument. */
+void *count_packets(void *arg) {
+	thread_pool_work_t *work = (thread_pool_work_t *)arg;
+	__sync_add_and_fetch((unsigned long *)work->arg, 1);
 	return(NULL);
 }
 
 int main(void) {
 	int num_threads = 1;
 	int x;
+	int group;
+	WorkQ_t group_queue;
+	unsigned long runs = 0;
+	unsigned long packets = 0;
    ThreadPool_t pool;
+	thread_pool_attr_t attr;
 	work_queue = workq_init(NULL, 0);
 
 	if(!work_queue) {
@@ -90,6 +119,11 @@ int main(void) {
 	ADD_OR_DIE(nine,  work_queue, 9);
 	ADD_OR_DIE(ten,   work_queue, 10);
 
+	if(thread_pool_create(-1, print_msg, NULL) || errno != EINVAL) {
+		printf("Negative pool size was accepted.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	printf("Kickstarting thread pool (%d threads)...\n", num_threads);
 	pool = thread_pool_create(num_threads, print_msg, NULL);
 
@@ -109,9 +143,100 @@ int main(void) {
 		sched_yield();
 	}
 
+   /* Destroying the queue wakes the threads blocked on it. */
+   kill_q();
+
    printf("Waiting on thread pool to die.\n");
    thread_pool_delete(pool);
 
+	printf("Waited for them to finish.\n");
+
+	printf("Starting %d idle threads with %d KiB stacks...\n", NUM_SMALL_THREADS, SMALL_STACK / 1024);
+	thread_pool_attr_init(&attr);
+	attr.stack_size = SMALL_STACK;
+	attr.prealloc_threads = NUM_SMALL_THREADS;
+	pool = thread_pool_create_ex(NUM_SMALL_THREADS, idle, NULL, &attr);
+
+	if(!pool || thread_pool_get_pool_size(pool) != NUM_SMALL_THREADS) {
+		printf("Small stack pool could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Trimming and regrowing the pool...\n");
+	thread_pool_trim(pool, NUM_SMALL_THREADS / 2);
+	while(thread_pool_get_pool_size(pool) > NUM_SMALL_THREADS / 2) {
+		sched_yield();
+	}
+	if(thread_pool_add(pool, NUM_SMALL_THREADS / 2, NULL) != BOOLEAN_TRUE ||
+			thread_pool_get_pool_size(pool) != NUM_SMALL_THREADS) {
+		printf("Pool did not regrow.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	thread_pool_delete(pool);
+
+	printf("Splitting a pool into worker groups...\n");
+	group_queue = workq_init(NULL, 0);
+	pool = thread_pool_create(4, idle, NULL);
+	if(!group_queue || !pool) {
+		printf("Group pool could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* The argument used to be dropped here. NULL keeps it. */
+	if(thread_pool_set_function(pool, count_runs, &runs) != BOOLEAN_TRUE ||
+			thread_pool_set_function(pool, count_runs, NULL) != BOOLEAN_TRUE) {
+		printf("Could not set the run function.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	group = thread_pool_group_create(pool, "packets", 2, count_packets, &packets, group_queue);
+	if(group < 0 || thread_pool_group_find(pool, "packets") != group ||
+			thread_pool_group_find(pool, "default") != 0) {
+		printf("Group could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for(x = 0; x < 1000; ++x) {
+		if(workq_add((const unsigned char *)more, strlen(more) + 1, group_queue, 1)) {
+			printf("Error adding to the group queue: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	while(__sync_add_and_fetch(&packets, 0) < 1000 || __sync_add_and_fetch(&runs, 0) == 0) {
+		sched_yield();
+	}
+
+	/* The group gets its threads right away, the trimmed ones leave on their own. */
+	thread_pool_trim(pool, 2);
+	if(thread_pool_group_add(pool, group, 2) != BOOLEAN_TRUE ||
+			thread_pool_group_get_size(pool, group) != 4) {
+		printf("Could not grow the group.\n");
+		exit(EXIT_FAILURE);
+	}
+	while(thread_pool_group_get_size(pool, 0) != 2) {
+		sched_yield();
+	}
+	if(thread_pool_get_pool_size(pool) != 6) {
+		printf("Pool has %u threads, expected 6.\n", thread_pool_get_pool_size(pool));
+		exit(EXIT_FAILURE);
+	}
+
+	/* The packet group's threads are blocked on an empty queue, they can't stand in. */
+	thread_pool_group_trim(pool, group, 2);
+	if(thread_pool_add(pool, 2, NULL) != BOOLEAN_TRUE || thread_pool_group_get_size(pool, 0) != 4) {
+		printf("Default group has %u threads, expected 4.\n", thread_pool_group_get_size(pool, 0));
+		exit(EXIT_FAILURE);
+	}
+
+	/* The surplus packet threads leave once their get fails, the rest wait for the delete. */
+	workq_destroy(group_queue);
+	while(thread_pool_group_get_size(pool, group) != 2) {
+		sched_yield();
+	}
+	thread_pool_delete(pool);
+	printf("Default group ran %lu times, packet group took %lu packets.\n", runs, packets);
+
 	printf("Waited for them to finish, now we're done.\n");
 
 	exit(EXIT_SUCCESS);
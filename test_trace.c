@@ -0,0 +1,227 @@
+/*
+ * test_trace.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Only built with THREAD_POOL_TRACE, see the Tupfile. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "workq.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#define NUM_PACKETS (500)
+#define NUM_KEYS (50)
+#define MAX_FLOWS (4 * NUM_PACKETS)
+
+typedef struct {
+	unsigned long long id;
+	double ts;
+} flow_t;
+
+const char *more = "More";
+
+flow_t starts[MAX_FLOWS];
+flow_t finishes[MAX_FLOWS];
+unsigned int num_starts = 0;
+unsigned int num_finishes = 0;
+
+void *idle(void *arg) {
+	usleep(1000);
+	return(NULL);
+}
+
+void *count_packets(void *arg) {
+	thread_pool_work_t *work = (thread_pool_work_t *)arg;
+	__sync_add_and_fetch((unsigned long *)work->arg, 1);
+	return(NULL);
+}
+
+/* Returns the flow with that id, NULL if there isn't one. */
+flow_t *find_flow(flow_t *flows, unsigned int num, unsigned long long id) {
+	unsigned int x;
+
+	for(x = 0; x < num; ++x) {
+		if(flows[x].id == id) {
+			return(&flows[x]);
+		}
+	}
+
+	return(NULL);
+}
+
+int main(void) {
+	char filename[] = "/tmp/test_trace.XXXXXX";
+	char line[1024];
+	FILE *in;
+	ThreadPool_t pool;
+	WorkQ_t queue;
+	workq_stats_t stats;
+	unsigned long packets = 0;
+	unsigned int steps = 0;
+	unsigned int runs = 0;
+	int group;
+	int fd;
+	int x;
+
+	queue = workq_init(NULL, 0);
+	if(!queue || workq_set_coalesce(queue, NULL)) {
+		printf("Can't initialize work queue: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	pool = thread_pool_create(1, idle, NULL);
+	if(!pool) {
+		printf("Pool could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	group = thread_pool_group_create(pool, "traced", 2, count_packets, &packets, queue);
+	if(group < 0) {
+		printf("Group could not be created: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Tracing %d plain and %d keyed packets...\n", NUM_PACKETS, NUM_PACKETS);
+	for(x = 0; x < NUM_PACKETS; ++x) {
+		if(workq_add((const unsigned char *)more, strlen(more) + 1, queue, 1) ||
+				workq_add_keyed((const unsigned char *)more, strlen(more) + 1, queue, 1, x % NUM_KEYS)) {
+			printf("Error adding packet: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Every token sent is run exactly once. */
+	workq_get_stats(queue, &stats);
+	while(__sync_add_and_fetch(&packets, 0) < stats.added) {
+		sched_yield();
+	}
+
+	workq_destroy(queue);
+	thread_pool_delete(pool);
+
+	fd = mkstemp(filename);
+	if(fd < 0) {
+		printf("Can't create the trace file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	if(trace_dump(filename)) {
+		printf("Can't dump the trace: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	in = fopen(filename, "r");
+	if(!in) {
+		printf("Can't read the trace back: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* One event per line. Flow starts first, they may come from any thread. */
+	while(fgets(line, sizeof(line), in)) {
+		char *ts = strstr(line, "\"ts\":");
+		char *id = strstr(line, "\"id\":");
+
+		if(!strstr(line, "\"name\":\"packet\"") || !ts || !id || !strstr(line, "\"ph\":\"s\"")) {
+			continue;
+		}
+
+		if(num_starts == MAX_FLOWS) {
+			printf("Too many flows in the trace.\n");
+			exit(EXIT_FAILURE);
+		}
+		starts[num_starts].ts = strtod(ts + 5, NULL);
+		starts[num_starts].id = strtoull(id + 5, NULL, 10);
+		num_starts++;
+	}
+
+	rewind(in);
+	while(fgets(line, sizeof(line), in)) {
+		char *ts = strstr(line, "\"ts\":");
+		char *id = strstr(line, "\"id\":");
+		char *packet = strstr(line, "\"packet\":");
+		flow_t *start;
+
+		/* A group run has to belong to a packet its thread dequeued, which
+		 * comes earlier in the same ring. The default group's runs carry 0.
+		 */
+		if(strstr(line, "\"ph\":\"B\"") && packet) {
+			if(!strtoull(packet + 9, NULL, 10)) {
+				continue;
+			}
+			if(!find_flow(finishes, num_finishes, strtoull(packet + 9, NULL, 10))) {
+				printf("Run of a packet that was never dequeued: %s", line);
+				exit(EXIT_FAILURE);
+			}
+			runs++;
+			continue;
+		}
+
+		if(!strstr(line, "\"name\":\"packet\"") || !ts || !id ||
+				(!strstr(line, "\"ph\":\"f\"") && !strstr(line, "\"ph\":\"t\""))) {
+			continue;
+		}
+
+		start = find_flow(starts, num_starts, strtoull(id + 5, NULL, 10));
+		if(!start || start->ts > strtod(ts + 5, NULL)) {
+			printf("Flow event without an earlier start: %s", line);
+			exit(EXIT_FAILURE);
+		}
+
+		if(strstr(line, "\"ph\":\"t\"")) {
+			steps++;
+			continue;
+		}
+
+		if(num_finishes == MAX_FLOWS) {
+			printf("Too many flows in the trace.\n");
+			exit(EXIT_FAILURE);
+		}
+		finishes[num_finishes].ts = strtod(ts + 5, NULL);
+		finishes[num_finishes].id = start->id;
+		num_finishes++;
+	}
+
+	fclose(in);
+	unlink(filename);
+
+	printf("%u starts, %u merges, %u finishes, %u runs\n", num_starts, steps, num_finishes, runs);
+
+	if(num_starts != stats.added || num_finishes != stats.added || steps != stats.coalesced) {
+		printf("Expected %lu starts and finishes and %lu merges.\n", stats.added, stats.coalesced);
+		exit(EXIT_FAILURE);
+	}
+
+	if(runs != stats.added) {
+		printf("Expected %lu runs carrying packet ids, got %u\n", stats.added, runs);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Tests passed.\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -25,8 +25,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "workq.h"
+#include "journal.h"
 
 #define ADD_OR_DIE(_s, _q, _p) \
 	if(workq_add((const unsigned char *)_s, strlen(_s) + 1, _q, _p)) { \
@@ -45,15 +50,71 @@ const char *seven = "Seven";
 const char *eight = "Eight";
 const char *nine = "Nine";
 const char *ten = "Ten";
+const char *more = "More";
+const char *stop = "Stop";
 
 WorkQ_t work_queue = NULL;
 
+/* Concatenates, reporting the full size even once it no longer fits. */
+size_t append(unsigned char *pending, size_t pending_size, const unsigned char *incoming, size_t incoming_size) {
+	if(pending_size + incoming_size <= WORKQ_MAX_SIZE) {
+		memcpy(pending + pending_size, incoming, incoming_size);
+	}
+	return(pending_size + incoming_size);
+}
+
 void kill_q(void) {
 	workq_destroy(work_queue);
 }
 
+unsigned long consumed = 0;
+
+/* Takes packets off the queue it's given until it gets a stop packet. */
+void *consume(void *arg) {
+	workq_msg_t msg;
+
+	while(1) {
+		if(workq_get((WorkQ_t)arg, &msg) < 0) {
+			printf("Consumer failed: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+		if(!strcmp((const char *)msg.data, stop)) {
+			return(NULL);
+		}
+		__sync_add_and_fetch(&consumed, 1);
+	}
+}
+
+double cpu_seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
 int main(void) {
 	workq_msg_t msg;
+	workq_stats_t before;
+	workq_stats_t after;
+	workq_handle_t handle;
+	WorkQ_t journaled;
+	WorkQ_t survivor;
+	workq_journal_opts_t opts;
+	char journal_dir[] = "/tmp/test_workq.XXXXXX";
+	char spill_dir[] = "/tmp/test_workq.XXXXXX";
+	char keyfile[] = "/tmp/test_workq_key.XXXXXX";
+	char cleanup[64];
+	unsigned char big[WORKQ_MAX_SIZE];
+	unsigned int segments;
+	DIR *dir;
+	struct dirent *ent;
+	pthread_t consumers[2];
+	WorkQ_t policy_queue;
+	double cpu;
+	pid_t child;
+	int status;
+	int fd;
+	int recovered;
 	int x;
 	int size = 0;
 
@@ -118,6 +179,342 @@ int main(void) {
 		}
 	}
 
+	printf("Switching to spin-then-park consumers...\n");
+	if(workq_set_wait_policy(work_queue, WORKQ_WAIT_SPIN_PARK, 50000)) {
+		printf("Error setting wait policy: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	ADD_OR_DIE(three, work_queue, 3);
+	ADD_OR_DIE(one, work_queue, 1);
+	ADD_OR_DIE(two, work_queue, 2);
+
+	printf("Removing from queue...\n");
+	for(x = 1; x <= 3; ++x) {
+		size = workq_get(work_queue, &msg);
+		if(size != strlen((const char *)msg.data) + 1 || msg.type != x) {
+			printf("Bad message \"%s\" priority %ld size %d\n", msg.data, msg.type, size);
+			exit(EXIT_FAILURE);
+		}
+		printf("Got message \"%s\" priority %ld\n", msg.data, msg.type);
+	}
+
+	printf("Switching to adaptive consumers...\n");
+	if(workq_set_wait_policy(work_queue, WORKQ_WAIT_ADAPTIVE, 50000)) {
+		printf("Error setting wait policy: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	for(x = 1; x <= 10; ++x) {
+		ADD_OR_DIE(more, work_queue, 5);
+		size = workq_get(work_queue, &msg);
+		if(size < 0) {
+			printf("Error pulling from queue: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+		printf("Got message \"%s\" priority %ld\n", msg.data, msg.type);
+	}
+
+	printf("Changing the wait policy under waiting consumers...\n");
+	policy_queue = workq_init(NULL, 0);
+	if(!policy_queue) {
+		printf("Error creating policy queue: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	for(x = 0; x < 2; ++x) {
+		pthread_create(&consumers[x], NULL, consume, policy_queue);
+	}
+	usleep(50000);
+
+	/* One consumer is parked in the kernel holding the queue mutex. */
+	if(workq_set_wait_policy(policy_queue, WORKQ_WAIT_SPIN, 0)) {
+		printf("Error setting wait policy: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	ADD_OR_DIE(more, policy_queue, 1);
+	while(__sync_add_and_fetch(&consumed, 0) < 1) {
+		usleep(1000);
+	}
+	usleep(50000);
+
+	/* Now one is spinning on it, and has to drop back to parking. */
+	if(workq_set_wait_policy(policy_queue, WORKQ_WAIT_PARK, 0)) {
+		printf("Error setting wait policy: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	usleep(50000);
+	cpu = cpu_seconds();
+	usleep(200000);
+	cpu = cpu_seconds() - cpu;
+	if(cpu > 0.1) {
+		printf("Consumers still spinning after switching to parking, %.3fs of CPU in 0.2s.\n", cpu);
+		exit(EXIT_FAILURE);
+	}
+
+	for(x = 0; x < 100; ++x) {
+		if(workq_add((const unsigned char *)more, strlen(more) + 1, policy_queue, 1)) {
+			printf("Error adding packet: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	ADD_OR_DIE(stop, policy_queue, 2);
+	ADD_OR_DIE(stop, policy_queue, 2);
+	for(x = 0; x < 2; ++x) {
+		pthread_join(consumers[x], NULL);
+	}
+	if(consumed != 101) {
+		printf("Expected 101 packets consumed, got %lu\n", consumed);
+		exit(EXIT_FAILURE);
+	}
+	workq_destroy(policy_queue);
+
+	printf("Coalescing a burst of keyed packets...\n");
+	if(workq_set_coalesce(work_queue, NULL)) {
+		printf("Error enabling coalescing: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	workq_get_stats(work_queue, &before);
+	for(x = 0; x < 10; ++x) {
+		const char *word[] = { one, two, three, four, five, six, seven, eight, nine, ten };
+
+		if(workq_add_keyed((const unsigned char *)word[x], strlen(word[x]) + 1, work_queue, 1, 42)) {
+			printf("Error adding keyed packet: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	workq_get_stats(work_queue, &after);
+
+	if(after.added - before.added != 1 || after.coalesced - before.coalesced != 9) {
+		printf("Expected 1 packet queued and 9 coalesced, got %lu and %lu\n", after.added - before.added, after.coalesced - before.coalesced);
+		exit(EXIT_FAILURE);
+	}
+
+	size = workq_get(work_queue, &msg);
+	if(size < 0 || strcmp((const char *)msg.data, ten)) {
+		printf("Expected the last write \"%s\", got \"%s\"\n", ten, msg.data);
+		exit(EXIT_FAILURE);
+	}
+	printf("Got message \"%s\" priority %ld\n", msg.data, msg.type);
+
+	printf("Rejecting a merge that outgrows a packet...\n");
+	{
+		unsigned char chunk[WORKQ_MAX_SIZE / 2 + 1];
+		WorkQ_t merge_queue = workq_init(NULL, 0);
+
+		if(!merge_queue || workq_set_coalesce(merge_queue, append)) {
+			printf("Error creating merge queue: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+
+		memset(chunk, 'x', sizeof(chunk));
+		if(workq_add_keyed(chunk, sizeof(chunk), merge_queue, 1, 7)) {
+			printf("Error adding keyed packet: %s (%d)\n", strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+
+		if(workq_add_keyed(chunk, sizeof(chunk), merge_queue, 1, 7) != -1 || errno != ENOSPC) {
+			printf("Oversized merge was accepted.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		size = workq_get(merge_queue, &msg);
+		if(size != (int)sizeof(chunk)) {
+			printf("Expected the unmerged %d bytes, got %d\n", (int)sizeof(chunk), size);
+			exit(EXIT_FAILURE);
+		}
+
+		workq_destroy(merge_queue);
+	}
+
+	printf("Cancelling one packet and letting another expire...\n");
+	workq_get_stats(work_queue, &before);
+
+	if(workq_add_ex((const unsigned char *)six, strlen(six) + 1, work_queue, 1, 0, &handle) ||
+			workq_add_ex((const unsigned char *)seven, strlen(seven) + 1, work_queue, 1, 1, NULL)) {
+		printf("Error adding packets: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	ADD_OR_DIE(eight, work_queue, 2);
+
+	if(workq_cancel(work_queue, handle)) {
+		printf("Error cancelling packet: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	usleep(5000);
+
+	size = workq_get(work_queue, &msg);
+	if(size < 0 || strcmp((const char *)msg.data, eight)) {
+		printf("Expected \"%s\", got \"%s\"\n", eight, msg.data);
+		exit(EXIT_FAILURE);
+	}
+	printf("Got message \"%s\" priority %ld\n", msg.data, msg.type);
+
+	workq_get_stats(work_queue, &after);
+	if(after.cancelled - before.cancelled != 1 || after.expired - before.expired != 1) {
+		printf("Expected 1 cancelled and 1 expired, got %lu and %lu\n", after.cancelled - before.cancelled, after.expired - before.expired);
+		exit(EXIT_FAILURE);
+	}
+
+	if(!workq_cancel(work_queue, handle)) {
+		printf("Cancelled a packet that's already gone.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Journaling packets across a restart...\n");
+	if(!mkdtemp(journal_dir) || !mkdtemp(spill_dir)) {
+		printf("Can't make a journal directory: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = mkstemp(keyfile);
+	if(fd < 0) {
+		printf("Can't create the key file: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	if(workq_init_journaled(NULL, 0, journal_dir, NULL) || errno != EINVAL) {
+		printf("A private journaled queue was accepted.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	journaled = workq_init_journaled(keyfile, 1, journal_dir, NULL);
+	if(!journaled) {
+		printf("Failed to initialize a journaled work queue: error %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	ADD_OR_DIE(three, journaled, 3);
+	ADD_OR_DIE(one, journaled, 1);
+	ADD_OR_DIE(two, journaled, 2);
+	ADD_OR_DIE(four, journaled, 4);
+
+	size = workq_get(journaled, &msg);
+	if(size < 0 || strcmp((const char *)msg.data, one)) {
+		printf("Expected \"%s\" from the journal, got \"%s\"\n", one, msg.data);
+		exit(EXIT_FAILURE);
+	}
+
+	workq_sync(journaled);
+	workq_destroy(journaled);
+
+	printf("Reopening, expecting the three pending packets back...\n");
+	journaled = workq_init_journaled(keyfile, 1, journal_dir, NULL);
+	if(!journaled) {
+		printf("Failed to reopen the journaled work queue: error %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Replay runs in the background, so the order isn't guaranteed. */
+	recovered = 0;
+	for(x = 2; x <= 4; ++x) {
+		size = workq_get(journaled, &msg);
+		if(size < 0 || msg.type < 2 || msg.type > 4 || (recovered & (1 << msg.type))) {
+			printf("Bad recovered message \"%s\" priority %ld\n", msg.data, msg.type);
+			exit(EXIT_FAILURE);
+		}
+		recovered |= 1 << msg.type;
+		printf("Got recovered message \"%s\" priority %ld\n", msg.data, msg.type);
+	}
+
+	printf("Crashing a producer between the append and the send...\n");
+	child = fork();
+	if(child < 0) {
+		printf("Can't fork: %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	if(!child) {
+		WorkQ_t producer = workq_init_journaled(keyfile, 1, journal_dir, NULL);
+		Journal_t journal = journal_open(journal_dir, 0, 1, 0, 0);
+		journal_loc_t loc;
+
+		/* One that makes it onto the queue, one that only makes it into the journal. */
+		if(!producer || !journal || workq_add((const unsigned char *)five, strlen(five) + 1, producer, 5) ||
+				journal_append(journal, 6, (const unsigned char *)six, strlen(six) + 1, &loc)) {
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	if(waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		printf("The producer failed.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The queue outlived the producer, so only the orphan gets resent. */
+	survivor = workq_init_journaled(keyfile, 1, journal_dir, NULL);
+	if(!survivor) {
+		printf("Failed to reopen the journaled work queue: error %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	recovered = 0;
+	for(x = 5; x <= 6; ++x) {
+		size = workq_get(survivor, &msg);
+		if(size < 0 || msg.type < 5 || msg.type > 6 || (recovered & (1 << msg.type))) {
+			printf("Bad recovered message \"%s\" priority %ld\n", msg.data, msg.type);
+			exit(EXIT_FAILURE);
+		}
+		recovered |= 1 << msg.type;
+		printf("Got recovered message \"%s\" priority %ld\n", msg.data, msg.type);
+	}
+
+	if(workq_try_get(survivor, &msg) != -1 || errno != ENOMSG) {
+		printf("Got \"%s\" twice.\n", msg.data);
+		exit(EXIT_FAILURE);
+	}
+
+	workq_destroy(journaled);
+	workq_destroy(survivor);
+	snprintf(cleanup, sizeof(cleanup), "rm -rf %s", journal_dir);
+	if(system(cleanup)) {
+		printf("Couldn't remove %s\n", journal_dir);
+	}
+
+	printf("Recycling journal segments...\n");
+	memset(&opts, 0, sizeof(opts));
+	opts.segment_size = 64 * 1024;
+
+	journaled = workq_init_journaled(keyfile, 2, spill_dir, &opts);
+	if(!journaled) {
+		printf("Failed to initialize a journaled work queue: error %s (%d)\n", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Enough to go through a couple of dozen segments. */
+	memset(big, 'x', sizeof(big));
+	for(x = 0; x < 1000; ++x) {
+		if(workq_add(big, sizeof(big), journaled, 1) || workq_get(journaled, &msg) != sizeof(big)) {
+			printf("Error cycling packet %d: %s (%d)\n", x, strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	segments = 0;
+	dir = opendir(spill_dir);
+	while(dir && (ent = readdir(dir))) {
+		if(!strncmp(ent->d_name, "seg.", 4)) {
+			segments++;
+		}
+	}
+	if(dir) {
+		closedir(dir);
+	}
+
+	if(segments < 1 || segments > 2) {
+		printf("Expected the retired segments to be recycled, found %u\n", segments);
+		exit(EXIT_FAILURE);
+	}
+
+	workq_destroy(journaled);
+	snprintf(cleanup, sizeof(cleanup), "rm -rf %s", spill_dir);
+	if(system(cleanup)) {
+		printf("Couldn't remove %s\n", spill_dir);
+	}
+	unlink(keyfile);
+
 	printf("Tests passed.\n");
 
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,216 @@
+/*
+ * test_workqset.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "workqset.h"
+
+#define NUM_TENANTS (3)
+#define NUM_ROUNDS (20)
+#define NUM_CONSUMERS (4)
+#define NUM_PER_TENANT (200)
+
+WorkQSet_t set = NULL;
+WorkQ_t queues[NUM_TENANTS];
+unsigned int weights[NUM_TENANTS] = { 1, 2, 4 };
+
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+int counts[NUM_TENANTS];
+
+void kill_qs(void) {
+	int x;
+
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		workq_destroy(queues[x]);
+	}
+}
+
+uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void fill(WorkQ_t q, int tenant, int num) {
+	int x;
+
+	for(x = 0; x < num; ++x) {
+		if(workq_add((const unsigned char *)&tenant, sizeof(tenant), q, 1)) {
+			printf("Error adding to tenant %d: %s\n", tenant, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void get_or_die(workq_msg_t *msg, unsigned int *member) {
+	if(workqset_get(set, msg, member) < 0) {
+		printf("Error getting from the set: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+void *consume(void *arg) {
+	workq_msg_t msg;
+	unsigned int member;
+
+	while(workqset_get(set, &msg, &member) > 0) {
+		pthread_mutex_lock(&count_lock);
+		counts[member]++;
+		pthread_mutex_unlock(&count_lock);
+	}
+
+	/* Only a destroyed set gets us here. */
+	if(errno != ENODEV) {
+		printf("Consumer failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return(NULL);
+}
+
+int main(void) {
+	pthread_t consumers[NUM_CONSUMERS];
+	workqset_stats_t stats;
+	workq_msg_t msg;
+	unsigned int member;
+	uint64_t start;
+	int total;
+	int x;
+
+	set = workqset_init();
+	if(!set) {
+		printf("Can't initialize the set.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		queues[x] = workq_init(NULL, 0);
+		if(!queues[x] || workqset_add(set, queues[x], weights[x], 0, 0) != x) {
+			printf("Can't set up tenant %d.\n", x);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	atexit(kill_qs);
+
+	printf("Weighted round robin over %d busy tenants...\n", NUM_TENANTS);
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		fill(queues[x], x, weights[x] * NUM_ROUNDS + 10);
+	}
+	for(x = 0; x < (1 + 2 + 4) * NUM_ROUNDS; ++x) {
+		get_or_die(&msg, &member);
+		counts[member]++;
+	}
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		printf("Tenant %d, weight %u: %d packets\n", x, weights[x], counts[x]);
+		if(counts[x] != weights[x] * NUM_ROUNDS) {
+			printf("Tenant %d got %d packets, expected %u.\n", x, counts[x], weights[x] * NUM_ROUNDS);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		while(workq_try_get(queues[x], &msg) >= 0);
+		counts[x] = 0;
+	}
+
+	printf("A noisy tenant doesn't hold up a quiet one...\n");
+	fill(queues[0], 0, 150);
+	fill(queues[1], 1, 5);
+	for(x = 0; x < 15; ++x) {
+		get_or_die(&msg, &member);
+		counts[member]++;
+	}
+	if(counts[1] != 5) {
+		printf("Quiet tenant only got %d of 5 packets.\n", counts[1]);
+		exit(EXIT_FAILURE);
+	}
+	while(workq_try_get(queues[0], &msg) >= 0);
+	counts[0] = counts[1] = 0;
+
+	printf("Rate limiting a tenant to 100 packets a second, bursts of 10...\n");
+	if(workqset_set_limits(set, 0, 1, 100, 10)) {
+		printf("Can't set the rate limit: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fill(queues[0], 0, 40);
+	start = now_ms();
+	for(x = 0; x < 30; ++x) {
+		get_or_die(&msg, &member);
+	}
+	/* The burst goes at once, the other 20 take 10 ms each. */
+	printf("30 packets took %llu ms\n", (unsigned long long)(now_ms() - start));
+	if(now_ms() - start < 150 || workqset_get_stats(set, 0, &stats) || !stats.throttled) {
+		printf("Rate limit was not applied.\n");
+		exit(EXIT_FAILURE);
+	}
+	/* At most one lost turn per packet, however often the poller looked. */
+	if(stats.throttled > 30) {
+		printf("Counted %lu throttled turns for 30 packets.\n", stats.throttled);
+		exit(EXIT_FAILURE);
+	}
+	while(workq_try_get(queues[0], &msg) >= 0);
+	workqset_set_limits(set, 0, 1, 0, 0);
+
+	printf("%d consumers on idle queues...\n", NUM_CONSUMERS);
+	for(x = 0; x < NUM_CONSUMERS; ++x) {
+		if(pthread_create(&consumers[x], NULL, consume, NULL)) {
+			printf("Can't start consumer %d.\n", x);
+			exit(EXIT_FAILURE);
+		}
+	}
+	usleep(50000);
+	for(x = 0; x < NUM_TENANTS; ++x) {
+		fill(queues[x], x, NUM_PER_TENANT);
+	}
+	workqset_wake(set);
+	do {
+		usleep(1000);
+		pthread_mutex_lock(&count_lock);
+		total = counts[0] + counts[1] + counts[2];
+		pthread_mutex_unlock(&count_lock);
+	} while(total < NUM_TENANTS * NUM_PER_TENANT);
+
+	/* Destroying the set releases the consumers. */
+	workqset_destroy(set);
+	for(x = 0; x < NUM_CONSUMERS; ++x) {
+		pthread_join(consumers[x], NULL);
+	}
+
+	/* The object outlives the destroy, late callers just find it dead. */
+	if(workqset_get(set, &msg, &member) != -1 || errno != ENODEV ||
+			workqset_get_stats(set, 0, &stats) != -1 || errno != ENODEV) {
+		printf("Destroyed set still answered.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Tests passed.\n");
+
+	exit(EXIT_SUCCESS);
+}
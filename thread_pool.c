@@ -24,9 +24,11 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <errno.h>
-#include <string.h> /* for memcpy() */
+#include <string.h> /* for memset() */
+#include <time.h>
 
 #include "thread_pool.h"
+#include "trace.h"
 
 #ifdef THREAD_POOL_DEBUG
 
@@ -47,60 +49,189 @@ void no_op(void)
 #define THREAD_POOL_MAGIC (0x54687264)
 #define THREAD_POOL_MAGIC_DELETED (0x46726565)
 
-/* Internal only pool type. */
+/* How long a queue-fed worker waits after a failed get before trying again. */
+#define THREAD_POOL_RETRY_NS (100 * 1000000L)
+
+/* Internal only worker group type. */
+typedef struct pool_group_t
+{
+   char *name;
+   Thread_t run_function;
+   void *arg;
+   WorkQ_t queue;
+   unsigned int desired_threads;
+   unsigned int running_threads;
+} pool_group_t;
+
+/* Internal only pool type.
+ * The pool's desired and running counts are the sums over its groups.
+ */
 typedef struct thread_pool_t
 {
    unsigned int magic;
    pthread_mutex_t pool_lock;
+   pthread_cond_t pool_cond;
    unsigned int desired_threads;
    unsigned int running_threads;
-   pthread_t *thread_table;
-   Thread_t run_function;
-   void *arg;
+   pthread_attr_t thread_attr;
+   struct pool_slot_chunk_t *slot_chunks;
+   struct pool_thread_arg_t *free_slots;
+   unsigned int num_slots;
+   unsigned int num_free_slots;
+   pool_group_t *groups;
+   unsigned int num_groups;
 } thread_pool_t;
 
 /** Internal only thread argument type.
- * Contains the passed argument.
+ * One per worker, it's the worker's slot in the pool.
  */
 typedef struct pool_thread_arg_t
 {
    thread_pool_t *pool;
-   /* Room for expansion */
+   pthread_t thread;
+   unsigned int group;
+   struct pool_thread_arg_t *next_free;
 } pool_thread_arg_t;
 
+/** Internal only block of worker slots.
+ * Slots are handed out from chunks, so a running worker's slot never moves
+ * and there's one allocation per batch of threads, not one per thread.
+ */
+typedef struct pool_slot_chunk_t
+{
+   struct pool_slot_chunk_t *next;
+   pool_thread_arg_t slots[];
+} pool_slot_chunk_t;
+
+/* WARNING: Only called from locked context.
+ * Makes sure there are at least num_needed free slots.
+ */
+static BOOLEAN _reserve_slots_from_locked_context(thread_pool_t *_pool, unsigned int num_needed)
+{
+   pool_slot_chunk_t *chunk;
+   unsigned int num_new;
+   unsigned int x;
+
+   if(_pool->num_free_slots >= num_needed) {
+      return(BOOLEAN_TRUE);
+   }
+
+   /* Grow by at least the current size, so repeated adds stay cheap. */
+   num_new = num_needed - _pool->num_free_slots;
+   if(num_new < _pool->num_slots) {
+      num_new = _pool->num_slots;
+   }
+
+   chunk = malloc(sizeof(*chunk) + num_new * sizeof(chunk->slots[0]));
+   if(!chunk) {
+      return(BOOLEAN_FALSE);
+   }
+
+   for(x = 0; x < num_new; ++x) {
+      chunk->slots[x].pool = _pool;
+      chunk->slots[x].next_free = _pool->free_slots;
+      _pool->free_slots = &chunk->slots[x];
+   }
+
+   chunk->next = _pool->slot_chunks;
+   _pool->slot_chunks = chunk;
+   _pool->num_slots += num_new;
+   _pool->num_free_slots += num_new;
+
+   THREAD_DEBUG_PRINTF("Grew to %u worker slots.\n", _pool->num_slots);
+
+   return(BOOLEAN_TRUE);
+}
+
+/* WARNING: Only called from locked context. */
+static void _release_slot_from_locked_context(thread_pool_t *_pool, pool_thread_arg_t *slot)
+{
+   slot->next_free = _pool->free_slots;
+   _pool->free_slots = slot;
+   _pool->num_free_slots++;
+}
+
 void *thread_wrap_function(void *arg)
 {
    pool_thread_arg_t *thread_arg = (pool_thread_arg_t*)arg;
+   thread_pool_t *pool = thread_arg->pool;
    void * return_value = NULL;
+   pool_group_t *group;
+   thread_pool_work_t work;
    void *run_arg;
    Thread_t function;
+   WorkQ_t queue;
 
    while(1) {
 
       /* Retrieve the thread parameters. */
-      pthread_mutex_lock(&thread_arg->pool->pool_lock);
-      run_arg = thread_arg->pool->arg;
-      function = thread_arg->pool->run_function;
-      pthread_mutex_unlock(&thread_arg->pool->pool_lock);
+      pthread_mutex_lock(&pool->pool_lock);
+      group = &pool->groups[thread_arg->group];
+      run_arg = group->arg;
+      function = group->run_function;
+      queue = group->queue;
+      pthread_mutex_unlock(&pool->pool_lock);
 
       /* Execute the thread function. */
-      return_value = function(run_arg);
+      if(queue) {
+         work.arg = run_arg;
+         work.size = workq_get(queue, &work.msg);
+         if(work.size >= 0) {
+            TRACE_EVENT(TRACE_RUN_BEGIN, TRACE_LAST_DEQUEUED());
+            return_value = function(&work);
+            TRACE_EVENT(TRACE_RUN_END, TRACE_LAST_DEQUEUED());
+         } else {
+            /* A destroyed queue fails every get at once. Instead of spinning
+             * on it, wait for a trim or thread_pool_delete() to let us go.
+             */
+            struct timespec until;
+
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += THREAD_POOL_RETRY_NS;
+            if(until.tv_nsec >= 1000000000L) {
+               until.tv_sec++;
+               until.tv_nsec -= 1000000000L;
+            }
+
+            pthread_mutex_lock(&pool->pool_lock);
+            group = &pool->groups[thread_arg->group];
+            if(pool->magic == THREAD_POOL_MAGIC && group->running_threads <= group->desired_threads) {
+               pthread_cond_timedwait(&pool->pool_cond, &pool->pool_lock, &until);
+            }
+            pthread_mutex_unlock(&pool->pool_lock);
+         }
+      } else {
+         TRACE_EVENT(TRACE_RUN_BEGIN, 0);
+         return_value = function(run_arg);
+         TRACE_EVENT(TRACE_RUN_END, 0);
+      }
 
-      pthread_mutex_lock(&thread_arg->pool->pool_lock);
+      pthread_mutex_lock(&pool->pool_lock);
 
-      if(thread_arg->pool->magic != THREAD_POOL_MAGIC) {
+      if(pool->magic != THREAD_POOL_MAGIC) {
          /* Pool object deleted or corrupted, bail out. */
-         pthread_mutex_unlock(&thread_arg->pool->pool_lock);
+         pthread_mutex_unlock(&pool->pool_lock);
          pthread_exit(return_value);
       }
 
-      if(thread_arg->pool->running_threads > thread_arg->pool->desired_threads) {
-         thread_arg->pool->running_threads--;
-         pthread_mutex_unlock(&thread_arg->pool->pool_lock);
-         free(thread_arg);
-         pthread_exit(return_value);
+      /* The group array may have moved while unlocked. */
+      group = &pool->groups[thread_arg->group];
+      if(group->running_threads <= group->desired_threads) {
+         pthread_mutex_unlock(&pool->pool_lock);
+         continue;
       }
-      pthread_mutex_unlock(&thread_arg->pool->pool_lock);
+
+      /* Nobody joins a trimmed thread, so it cleans up after itself.
+       * thread_pool_delete() waits on the condition for the last one.
+       * The slot may be reused as soon as the lock drops, don't touch it after.
+       */
+      group->running_threads--;
+      _release_slot_from_locked_context(pool, thread_arg);
+      pool->running_threads--;
+      pthread_detach(pthread_self());
+      pthread_cond_broadcast(&pool->pool_cond);
+      pthread_mutex_unlock(&pool->pool_lock);
+      pthread_exit(return_value);
    }
 
    THREAD_DEBUG_PRINTF("Unexpected exit from run loop.\n");
@@ -110,71 +241,87 @@ void *thread_wrap_function(void *arg)
 
 unsigned int thread_pool_set_function(ThreadPool_t pool, Thread_t thread_function, void *arg)
 {
-   thread_pool_t *_pool = (thread_pool_t*)pool;
+   return(thread_pool_group_set_function(pool, 0, thread_function, arg));
+}
 
-   pthread_mutex_lock(&_pool->pool_lock);
+/* WARNING: Only called from locked context.
+ * Recounts the pool's desired threads after a group changed size.
+ */
+static void _sum_desired_from_locked_context(thread_pool_t *_pool)
+{
+   unsigned int x;
 
-   if(_pool->magic != THREAD_POOL_MAGIC) {
-      pthread_mutex_unlock(&_pool->pool_lock);
-      return(BOOLEAN_FALSE);
+   _pool->desired_threads = 0;
+   for(x = 0; x < _pool->num_groups; ++x) {
+      _pool->desired_threads += _pool->groups[x].desired_threads;
    }
+}
 
-	_pool->run_function = thread_function;
-   pthread_mutex_unlock(&_pool->pool_lock);
-
-   THREAD_DEBUG_PRINTF("Updated run function.\n");
-
-	return(1);
+/* WARNING: Only called from locked context.
+ * Gives up on the threads a group could not get.
+ */
+static void _drop_missing_from_locked_context(thread_pool_t *_pool, unsigned int group)
+{
+   _pool->groups[group].desired_threads = _pool->groups[group].running_threads;
+   _sum_desired_from_locked_context(_pool);
 }
 
 /* WARNING: Only called from locked context.
- * Adds threads to pool.
+ * Spawns the threads a group is short of. Threads over another group's
+ * count don't make up for them, they may be blocked in their run function
+ * for good; they exit when they next finish a run. All of them share the
+ * pool's thread attributes and take their slots from one reservation.
  */
-static void _add_threads_from_locked_context(thread_pool_t *_pool)
+static BOOLEAN _add_threads_from_locked_context(thread_pool_t *_pool, unsigned int group)
 {
-   unsigned int x = _pool->running_threads;
-   BOOLEAN *fail_table;
-   unsigned int failed = 0;
+   pool_group_t *_group = &_pool->groups[group];
 
-   /* This shouldn't be needed, since it's static and only called from init and add operations. */
-   if(_pool->running_threads < _pool->desired_threads) {
-      THREAD_DEBUG_PRINTF("Got called with running threads %u and desired threads %u.\n", _pool->running_threads, _pool->desired_threads);
-      return;
+   if(_group->running_threads >= _group->desired_threads) {
+      return(BOOLEAN_TRUE);
    }
 
-   fail_table = calloc(_pool->desired_threads - _pool->running_threads, sizeof(BOOLEAN));
-
-	for( ; x < _pool->desired_threads; ++x) {
+   if(_reserve_slots_from_locked_context(_pool, _group->desired_threads - _group->running_threads) != BOOLEAN_TRUE) {
+      _drop_missing_from_locked_context(_pool, group);
+      return(BOOLEAN_FALSE);
+   }
 
-      /* The thread function's cleanup frees the argument. */
-      pool_thread_arg_t *thread_arg = calloc(1, sizeof(*thread_arg));
+   while(_group->running_threads < _group->desired_threads) {
+      pool_thread_arg_t *thread_arg = _pool->free_slots;
 
-      thread_arg->pool = _pool;
-		if(!pthread_create(&_pool->thread_table[x], NULL, thread_wrap_function, thread_arg)) {
-         _pool->running_threads++;
-		} else {
-         failed = BOOLEAN_TRUE;
-         fail_table[x] = BOOLEAN_TRUE;
+      thread_arg->group = group;
+		if(pthread_create(&thread_arg->thread, &_pool->thread_attr, thread_wrap_function, thread_arg)) {
+         break;
       }
+      _pool->free_slots = thread_arg->next_free;
+      _pool->num_free_slots--;
+      _pool->running_threads++;
+      _group->running_threads++;
 	}
 
-   if(failed) {
-      pthread_t *thread_table = calloc(_pool->running_threads, sizeof(*_pool->thread_table));
-      unsigned int y = 0;
-
-      /* Copy loop without failed threads. Note the y++ inside the loop! */
-      for(x = 0; x < _pool->desired_threads; ++x) {
-         if(!fail_table[x]) {
-            thread_table[y++] = _pool->thread_table[x];
-         }
-      }
+   if(_group->running_threads < _group->desired_threads) {
+      THREAD_DEBUG_PRINTF("Only started %u of %u threads in group %u.\n", _group->running_threads, _group->desired_threads, group);
+      _drop_missing_from_locked_context(_pool, group);
+      return(BOOLEAN_FALSE);
    }
-   free(fail_table);
+
+   return(BOOLEAN_TRUE);
+}
+
+void thread_pool_attr_init(thread_pool_attr_t *attr)
+{
+   /* Zero is the default for every field. */
+   memset(attr, 0, sizeof(*attr));
 }
 
 ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *arg)
+{
+   return(thread_pool_create_ex(num_threads, run_function, arg, NULL));
+}
+
+ThreadPool_t thread_pool_create_ex(int num_threads, Thread_t run_function, void *arg, const thread_pool_attr_t *attr)
 {
    thread_pool_t *_pool = NULL;
+   unsigned int num_slots = num_threads;
 
 	if(!run_function) {
 		errno = ENODEV;
@@ -184,6 +331,14 @@ ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *ar
 		return(0);
 	}
 
+   if(num_threads < 0) {
+      errno = EINVAL;
+
+      THREAD_DEBUG_PRINTF("Negative thread count %d.\n", num_threads);
+
+      return(0);
+   }
+
    _pool = calloc(1, sizeof(*_pool));
 	if(!_pool) {
       /* calloc() sets errno for us */
@@ -194,14 +349,58 @@ ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *ar
 	}
 
    _pool->magic = THREAD_POOL_MAGIC;
-   _pool->arg = arg;
 
-   _pool->thread_table = calloc(num_threads, sizeof(*_pool->thread_table));
-	if(!_pool->thread_table) {
-      /* calloc() sets errno for us */
+   _pool->groups = calloc(1, sizeof(*_pool->groups));
+   if(_pool->groups) {
+      _pool->groups[0].name = strdup("default");
+   }
+   if(!_pool->groups || !_pool->groups[0].name) {
+      /* calloc() and strdup() set errno for us */
+
+      THREAD_DEBUG_PRINTF("Out of memory for the default group.\n");
+
+      free(_pool->groups);
+      free(_pool);
+      return(0);
+   }
+   _pool->num_groups = 1;
+   _pool->groups[0].arg = arg;
+
+   pthread_attr_init(&_pool->thread_attr);
 
-      THREAD_DEBUG_PRINTF("calloc(): failed for thread table.\n");
+   if(attr) {
+      /* Stacks are only reserved, not touched, but 8 MiB of address space
+       * each adds up fast with thousands of workers.
+       */
+      if(attr->stack_size && pthread_attr_setstacksize(&_pool->thread_attr, attr->stack_size)) {
+         THREAD_DEBUG_PRINTF("Bad stack size %zu.\n", attr->stack_size);
+
+         pthread_attr_destroy(&_pool->thread_attr);
+         free(_pool->groups[0].name);
+         free(_pool->groups);
+         free(_pool);
+         errno = EINVAL;
+         return(0);
+      }
+      /* Zero keeps the default guard, a zeroed struct shouldn't lose overflow protection. */
+      if(attr->guard_size) {
+         pthread_attr_setguardsize(&_pool->thread_attr, attr->guard_size);
+      }
+
+      if(attr->prealloc_threads > num_slots) {
+         num_slots = attr->prealloc_threads;
+      }
+   }
 
+   /* Slots for the whole expected pool in one go. */
+   if(num_slots && _reserve_slots_from_locked_context(_pool, num_slots) != BOOLEAN_TRUE) {
+      /* malloc() sets errno for us */
+
+      THREAD_DEBUG_PRINTF("malloc(): failed for worker slots.\n");
+
+      pthread_attr_destroy(&_pool->thread_attr);
+      free(_pool->groups[0].name);
+      free(_pool->groups);
       free(_pool);
 		return(0);
 	}
@@ -210,12 +409,14 @@ ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *ar
    THREAD_DEBUG_PRINTF("Created the pool object.\n");
 
    pthread_mutex_init(&_pool->pool_lock, NULL);
-	_pool->run_function = run_function;
+   pthread_cond_init(&_pool->pool_cond, NULL);
+	_pool->groups[0].run_function = run_function;
+   _pool->groups[0].desired_threads = num_threads;
    _pool->desired_threads = num_threads;
 
    /* Note that a lock must take place here, since the threads will really be starting and the loop should finish first. */
    pthread_mutex_lock(&_pool->pool_lock);
-   _add_threads_from_locked_context(_pool);
+   _add_threads_from_locked_context(_pool, 0);
    pthread_mutex_unlock(&_pool->pool_lock);
 
 	return(_pool);
@@ -223,10 +424,9 @@ ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *ar
 
 void thread_pool_delete(ThreadPool_t pool)
 {
-   unsigned int x;
-   unsigned int threads;
-   pthread_t *thread_table;
    thread_pool_t *_pool = (ThreadPool_t)pool;
+   pool_slot_chunk_t *chunk;
+   unsigned int x;
 
    if(!_pool) {
       return;
@@ -238,96 +438,238 @@ void thread_pool_delete(ThreadPool_t pool)
    }
 
    pthread_mutex_lock(&_pool->pool_lock);
-   threads = _pool->running_threads;
-   thread_table = calloc(threads, sizeof(*thread_table));
-   memcpy(thread_table, _pool->thread_table, sizeof(*thread_table) * threads);
 
    /* Let the cleanup do its job. */
+   for(x = 0; x < _pool->num_groups; ++x) {
+      _pool->groups[x].desired_threads = 0;
+   }
    _pool->desired_threads = 0;
+   pthread_cond_broadcast(&_pool->pool_cond);
 
-   pthread_mutex_unlock(&_pool->pool_lock);
-
-   /* Wait for all the threads to exit. */
-   for(x = threads; x > 0; --x) {
-      pthread_join(thread_table[x], NULL);
+   /* Wait for all the threads to exit. Each one detaches itself, so there is nothing to join. */
+   while(_pool->running_threads) {
+      pthread_cond_wait(&_pool->pool_cond, &_pool->pool_lock);
    }
 
-   free(thread_table);
-
-   /* Leave thread object in a locked state before free(). */
-   pthread_mutex_lock(&_pool->pool_lock);
+   /* Object stays in a locked state before free(). */
 
    /* Set deleted marker. */
    _pool->magic = THREAD_POOL_MAGIC_DELETED;
 
-   _pool->running_threads = 0;
-   free(_pool->thread_table);
+   while((chunk = _pool->slot_chunks)) {
+      _pool->slot_chunks = chunk->next;
+      free(chunk);
+   }
+
+   for(x = 0; x < _pool->num_groups; ++x) {
+      free(_pool->groups[x].name);
+   }
+   free(_pool->groups);
+
+   pthread_attr_destroy(&_pool->thread_attr);
+   pthread_cond_destroy(&_pool->pool_cond);
    free(_pool);
 }
 
 void thread_pool_trim(ThreadPool_t pool, unsigned int num_to_cut)
+{
+   thread_pool_group_trim(pool, 0, num_to_cut);
+}
+
+BOOLEAN thread_pool_add(ThreadPool_t pool, unsigned int num_to_add, void *arg)
+{
+   thread_pool_t *_pool = (ThreadPool_t)pool;
+
+   if(arg) {
+      pthread_mutex_lock(&_pool->pool_lock);
+      if(_pool->magic == THREAD_POOL_MAGIC) {
+         _pool->groups[0].arg = arg;
+      }
+      pthread_mutex_unlock(&_pool->pool_lock);
+   }
+
+   return(thread_pool_group_add(pool, 0, num_to_add));
+}
+
+unsigned int thread_pool_get_pool_size(ThreadPool_t pool)
+{
+   unsigned int size = 0;
+   thread_pool_t *_pool = (ThreadPool_t)pool;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+   if(_pool->magic == THREAD_POOL_MAGIC) {
+      size = _pool->running_threads;
+   }
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(size);
+}
+
+int thread_pool_group_create(ThreadPool_t pool, const char *name, unsigned int num_threads, Thread_t run_function, void *arg, WorkQ_t queue)
 {
    thread_pool_t *_pool = (ThreadPool_t)pool;
+   pool_group_t *groups;
+   pool_group_t *group;
+   char *group_name;
+   int rv;
+
+   if(!run_function || !name) {
+      errno = EINVAL;
+      return(-1);
+   }
+
+   group_name = strdup(name);
+   if(!group_name) {
+      /* strdup() sets errno for us */
+      return(-1);
+   }
+
    pthread_mutex_lock(&_pool->pool_lock);
 
    if(_pool->magic != THREAD_POOL_MAGIC) {
       pthread_mutex_unlock(&_pool->pool_lock);
-      return;
+      free(group_name);
+      errno = ENODEV;
+      return(-1);
    }
 
-   /* Safety: Only trim if the size can handle it, otherwise, drop pool to zero. */
-   if(_pool->desired_threads >= num_to_cut) {
-      _pool->desired_threads -= num_to_cut;
-   } else {
-      /* Not really sure why you'd drop all threads and not delete the pool object,
-       * but just in case the operation is supported.
-       */
-      _pool->desired_threads = 0;
+   groups = realloc(_pool->groups, (_pool->num_groups + 1) * sizeof(*groups));
+   if(!groups) {
+      /* realloc() sets errno for us */
+      pthread_mutex_unlock(&_pool->pool_lock);
+      free(group_name);
+      return(-1);
    }
+   _pool->groups = groups;
+
+   rv = _pool->num_groups++;
+   group = &_pool->groups[rv];
+   memset(group, 0, sizeof(*group));
+   group->name = group_name;
+   group->run_function = run_function;
+   group->arg = arg;
+   group->queue = queue;
+   group->desired_threads = num_threads;
+
+   THREAD_DEBUG_PRINTF("Created group %d, %s.\n", rv, group_name);
 
+   _sum_desired_from_locked_context(_pool);
+   _add_threads_from_locked_context(_pool, rv);
    pthread_mutex_unlock(&_pool->pool_lock);
+
+   return(rv);
 }
 
-BOOLEAN thread_pool_add(ThreadPool_t pool, unsigned int num_to_add, void *arg)
+int thread_pool_group_find(ThreadPool_t pool, const char *name)
 {
    thread_pool_t *_pool = (ThreadPool_t)pool;
-   pthread_t *thread_table;
+   unsigned int x;
+   int rv = -1;
 
    pthread_mutex_lock(&_pool->pool_lock);
+   if(_pool->magic == THREAD_POOL_MAGIC) {
+      for(x = 0; x < _pool->num_groups; ++x) {
+         if(!strcmp(_pool->groups[x].name, name)) {
+            rv = x;
+            break;
+         }
+      }
+   }
+   pthread_mutex_unlock(&_pool->pool_lock);
 
-   if(_pool->magic != THREAD_POOL_MAGIC) {
+   if(rv < 0) {
+      errno = ENOENT;
+   }
+
+   return(rv);
+}
+
+BOOLEAN thread_pool_group_set_function(ThreadPool_t pool, unsigned int group, Thread_t thread_function, void *arg)
+{
+   thread_pool_t *_pool = (thread_pool_t*)pool;
+
+   if(!thread_function) {
+      return(BOOLEAN_FALSE);
+   }
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   if(_pool->magic != THREAD_POOL_MAGIC || group >= _pool->num_groups) {
       pthread_mutex_unlock(&_pool->pool_lock);
       return(BOOLEAN_FALSE);
    }
 
+   _pool->groups[group].run_function = thread_function;
    if(arg) {
-      _pool->arg = arg;
+      _pool->groups[group].arg = arg;
    }
+   pthread_mutex_unlock(&_pool->pool_lock);
+
+   THREAD_DEBUG_PRINTF("Updated run function of group %u.\n", group);
+
+   return(BOOLEAN_TRUE);
+}
+
+BOOLEAN thread_pool_group_add(ThreadPool_t pool, unsigned int group, unsigned int num_to_add)
+{
+   thread_pool_t *_pool = (ThreadPool_t)pool;
+   pool_group_t *_group;
+   BOOLEAN rv;
 
-   thread_table = realloc(_pool->thread_table, (_pool->desired_threads * sizeof(*_pool->thread_table)));
+   pthread_mutex_lock(&_pool->pool_lock);
 
-   if(!thread_table) {
+   if(_pool->magic != THREAD_POOL_MAGIC || group >= _pool->num_groups) {
       pthread_mutex_unlock(&_pool->pool_lock);
       return(BOOLEAN_FALSE);
    }
 
-   free(_pool->thread_table);
-   _pool->thread_table = thread_table;
-   _pool->desired_threads = _pool->running_threads + num_to_add;
-   _add_threads_from_locked_context(_pool);
+   /* Threads still waiting to leave after a trim stay, as before groups. */
+   _group = &_pool->groups[group];
+   if(_group->desired_threads < _group->running_threads) {
+      _group->desired_threads = _group->running_threads;
+   }
+   _group->desired_threads += num_to_add;
+
+   _sum_desired_from_locked_context(_pool);
+   rv = _add_threads_from_locked_context(_pool, group);
    pthread_mutex_unlock(&_pool->pool_lock);
 
-   return(BOOLEAN_TRUE);
+   return(rv);
 }
 
-unsigned int thread_pool_get_pool_size(ThreadPool_t pool)
+void thread_pool_group_trim(ThreadPool_t pool, unsigned int group, unsigned int num_to_cut)
+{
+   thread_pool_t *_pool = (ThreadPool_t)pool;
+   pool_group_t *_group;
+
+   pthread_mutex_lock(&_pool->pool_lock);
+
+   if(_pool->magic != THREAD_POOL_MAGIC || group >= _pool->num_groups) {
+      pthread_mutex_unlock(&_pool->pool_lock);
+      return;
+   }
+
+   /* Safety: Only trim if the size can handle it, otherwise, drop the group to zero. */
+   _group = &_pool->groups[group];
+   if(_group->desired_threads >= num_to_cut) {
+      _group->desired_threads -= num_to_cut;
+   } else {
+      _group->desired_threads = 0;
+   }
+
+   _sum_desired_from_locked_context(_pool);
+   pthread_cond_broadcast(&_pool->pool_cond);
+   pthread_mutex_unlock(&_pool->pool_lock);
+}
+
+unsigned int thread_pool_group_get_size(ThreadPool_t pool, unsigned int group)
 {
    unsigned int size = 0;
    thread_pool_t *_pool = (ThreadPool_t)pool;
 
    pthread_mutex_lock(&_pool->pool_lock);
-   if(_pool->magic == THREAD_POOL_MAGIC) {
-      size = _pool->running_threads;
+   if(_pool->magic == THREAD_POOL_MAGIC && group < _pool->num_groups) {
+      size = _pool->groups[group].running_threads;
    }
    pthread_mutex_unlock(&_pool->pool_lock);
 
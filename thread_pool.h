@@ -27,6 +27,12 @@
 
 #include <pthread.h>
 
+#include "workq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define BOOLEAN unsigned int
 #define BOOLEAN_FALSE (1)
 #define BOOLEAN_TRUE (!(BOOLEAN_FALSE))
@@ -37,6 +43,20 @@ typedef void *ThreadPool_t;
 /** Thread function type. */
 typedef void *(*Thread_t)(void*);
 
+/** Thread pool attributes, see thread_pool_create_ex(). */
+typedef struct {
+   size_t stack_size; /**< Worker stack size in bytes, 0 for the system default. */
+   size_t guard_size; /**< Guard area at the end of each stack in bytes, 0 for the system default. */
+   unsigned int prealloc_threads; /**< Worker slots to allocate up front. The pool can still grow past it. */
+} thread_pool_attr_t;
+
+/** Work handed to the run function of a group fed by a work queue, see thread_pool_group_create(). */
+typedef struct {
+   void *arg; /**< The group argument. */
+   ssize_t size; /**< Payload size. */
+   workq_msg_t msg; /**< The packet taken off the group's queue. */
+} thread_pool_work_t;
+
 /**
  * @brief Create and return a thread pool object.
  *
@@ -46,14 +66,47 @@ typedef void *(*Thread_t)(void*);
  * @param run_function function for each thread to run
  * @param arg argument to each thread
  *
- * return a thread pool object, or NULL on failure (errno is set)
+ * return a thread pool object, or NULL on failure (errno is set, EINVAL
+ * for a negative num_threads)
  */
 ThreadPool_t thread_pool_create(int num_threads, Thread_t run_function, void *arg);
 
+/**
+ * @brief Initialize thread pool attributes to the defaults.
+ *
+ * The defaults match thread_pool_create(): system stack and guard sizes,
+ * and worker slots for the initial threads only. A zeroed struct means
+ * the same.
+ *
+ * @param attr the attributes to initialize
+ */
+void thread_pool_attr_init(thread_pool_attr_t *attr);
+
+/**
+ * @brief Create and return a thread pool object with attributes.
+ *
+ * Same as thread_pool_create(), but the workers are created with the
+ * given stack and guard sizes, which is what keeps pools of thousands
+ * of mostly idle threads small. Worker slots for prealloc_threads threads
+ * are allocated at once, so growing the pool up to that size allocates nothing.
+ *
+ * @param num_threads number of threads in the pool
+ * @param run_function function for each thread to run
+ * @param arg argument to each thread
+ * @param attr attributes set up with thread_pool_attr_init(), or NULL for the defaults
+ *
+ * return a thread pool object, or NULL on failure (errno is set, EINVAL
+ * for a negative num_threads)
+ */
+ThreadPool_t thread_pool_create_ex(int num_threads, Thread_t run_function, void *arg, const thread_pool_attr_t *attr);
+
 /**
  * @brief Set a new thread function.
  *
  * Existing threads will complete, then execute the new function.
+ * Only the default group is affected, see thread_pool_group_set_function().
+ *
+ * If arg is NULL the previous value will be used.
  *
  * @param pool the pool object
  * @param thread_function the new thread function
@@ -75,6 +128,8 @@ void thread_pool_delete(ThreadPool_t pool);
 /**
  * @brief Trim a thread pool's size.
  *
+ * Trims the default group, see thread_pool_group_trim().
+ *
  * Threads will exit on completion of the thread pool
  * function until the desired size is reached. The thread
  * pool size will shrink until it reaches the desired size.
@@ -89,7 +144,8 @@ void thread_pool_trim(ThreadPool_t pool, unsigned int num_to_cut);
 /**
  * @brief Add threads to a thread pool.
  * 
- * Immediately spawns new threads to the pool.
+ * Immediately spawns new threads to the pool. The threads join the
+ * default group, see thread_pool_group_add().
  *
  * If arg is NULL the previous value will be used.
  *
@@ -104,6 +160,8 @@ BOOLEAN thread_pool_add(ThreadPool_t pool, unsigned int num_to_add, void *arg);
 /**
  * @brief Get the number of active threads in the pool.
  *
+ * Counts the threads of all groups.
+ *
  * This will be greater than or equal to the number of desired threads.
  * The number of threads can vary if the pool is in a shrink operation
  * and has not yet reached the desired size.
@@ -114,4 +172,98 @@ BOOLEAN thread_pool_add(ThreadPool_t pool, unsigned int num_to_add, void *arg);
  */
 unsigned int thread_pool_get_pool_size(ThreadPool_t pool);
 
+/**
+ * @brief Add a named worker group to a thread pool.
+ *
+ * A group is a set of workers with its own run function and argument.
+ * Every pool starts out with one group, the default group (number 0),
+ * which runs the function given to thread_pool_create().
+ *
+ * Each group has threads of its own. Growing a group spawns its new
+ * threads right away, trimming one lets its extra threads exit when they
+ * next finish a run. Threads never move between groups, a thread trimmed
+ * from one group may stay blocked in its run function for a long time.
+ *
+ * If queue is given, each run of the group takes a packet off the queue
+ * and calls the run function with a thread_pool_work_t holding the
+ * packet and arg. Workers then block on the queue; destroy the queue
+ * before deleting the pool. Once it is gone they wait to be trimmed.
+ *
+ * Groups stay until the pool is deleted, trim one to zero to retire it.
+ *
+ * @param pool the pool object
+ * @param name the group name, copied
+ * @param num_threads number of threads in the group
+ * @param run_function function for the group's threads to run
+ * @param arg the thread argument
+ * @param queue work queue feeding the group, or NULL
+ *
+ * return the group number, or -1 on failure (errno is set)
+ */
+int thread_pool_group_create(ThreadPool_t pool, const char *name, unsigned int num_threads, Thread_t run_function, void *arg, WorkQ_t queue);
+
+/**
+ * @brief Look up a worker group by name.
+ *
+ * @param pool the pool object
+ * @param name the group name
+ *
+ * return the group number, or -1 if there is no such group (errno is set)
+ */
+int thread_pool_group_find(ThreadPool_t pool, const char *name);
+
+/**
+ * @brief Set a group's thread function and argument.
+ *
+ * The group's threads will complete, then execute the new function.
+ * If arg is NULL the previous value will be used.
+ *
+ * @param pool the pool object
+ * @param group the group number
+ * @param thread_function the new thread function
+ * @param arg the new thread argument
+ *
+ * return BOOLEAN_TRUE on success, BOOLEAN_FALSE on failure
+ */
+BOOLEAN thread_pool_group_set_function(ThreadPool_t pool, unsigned int group, Thread_t thread_function, void *arg);
+
+/**
+ * @brief Add threads to a worker group.
+ *
+ * Immediately spawns new threads to the group. Threads trimmed from the
+ * group and not yet gone are kept instead.
+ *
+ * @param pool the pool object
+ * @param group the group number
+ * @param num_to_add how many threads to add
+ *
+ * return BOOLEAN_TRUE on success, BOOLEAN_FALSE on failure
+ */
+BOOLEAN thread_pool_group_add(ThreadPool_t pool, unsigned int group, unsigned int num_to_add);
+
+/**
+ * @brief Trim a worker group's size.
+ *
+ * Like thread_pool_trim(), the group shrinks as its threads complete.
+ *
+ * @param pool the pool object
+ * @param group the group number
+ * @param num_to_cut the number of threads to remove
+ */
+void thread_pool_group_trim(ThreadPool_t pool, unsigned int group, unsigned int num_to_cut);
+
+/**
+ * @brief Get the number of threads working for a group.
+ *
+ * @param pool the pool object
+ * @param group the group number
+ *
+ * return the number of threads in the group
+ */
+unsigned int thread_pool_group_get_size(ThreadPool_t pool, unsigned int group);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // THREAD_POOL_H
@@ -0,0 +1,704 @@
+
+/*
+ * thread_pool.hpp
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Header only C++ layer over workq.h and thread_pool.h.
+ *
+ *    thread_pool::work_queue<T>  typed work queue, packets are T by value
+ *    thread_pool::task           move only void() callable, small closures stored inline
+ *    thread_pool::pool           owns a ThreadPool_t, runs any callable
+ *    thread_pool::task_pool      pool that runs submitted tasks
+ *
+ * Everything compiles down to the C calls it wraps; the only additions
+ * are the copies a hand written wrapper would do anyway. Errors from the
+ * C API are thrown as std::system_error carrying errno.
+ *
+ * Needs C++11.
+ */
+
+#pragma once
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP 1
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "workq.h"
+#include "thread_pool.h"
+
+namespace thread_pool {
+
+namespace detail {
+
+inline void throw_errno(const char *what)
+{
+   throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* Packets carry T's bytes, the way the C API is used by hand. */
+template<class T>
+struct codec
+{
+   static_assert(std::is_trivially_copyable<T>::value,
+         "work_queue<T> needs a trivially copyable T, or a std::unique_ptr for private queues");
+   static_assert(sizeof(T) <= WORKQ_MAX_SIZE, "T does not fit in a work queue packet");
+
+   static const bool owning = false;
+
+   static int send(WorkQ_t q, const T &value, long prio)
+   {
+      return workq_add(reinterpret_cast<const unsigned char *>(&value), sizeof(T), q, prio);
+   }
+
+   static bool fits(ssize_t size)
+   {
+      return size == sizeof(T);
+   }
+
+   /* Built from the bytes, T needn't be default constructible. */
+   static T decode(const workq_msg_t &msg)
+   {
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type raw;
+
+      std::memcpy(&raw, msg.data, sizeof(T));
+      return *reinterpret_cast<T *>(&raw);
+   }
+
+   static void discard(const workq_msg_t &, ssize_t)
+   {
+   }
+};
+
+/* Packets carry the pointer, ownership moves through the queue.
+ * Only meaningful within one process, so only on private queues.
+ */
+template<class U, class D>
+struct codec<std::unique_ptr<U, D> >
+{
+   typedef std::unique_ptr<U, D> T;
+   typedef typename T::pointer pointer;
+
+   static const bool owning = true;
+
+   static int send(WorkQ_t q, T &&value, long prio)
+   {
+      pointer p = value.get();
+      int rv = workq_add(reinterpret_cast<const unsigned char *>(&p), sizeof(p), q, prio);
+
+      if(!rv) {
+         value.release();
+      }
+      return rv;
+   }
+
+   static bool fits(ssize_t size)
+   {
+      return size == sizeof(pointer);
+   }
+
+   static T decode(const workq_msg_t &msg)
+   {
+      pointer p;
+
+      std::memcpy(&p, msg.data, sizeof(p));
+      return T(p);
+   }
+
+   static void discard(const workq_msg_t &msg, ssize_t size)
+   {
+      if(fits(size)) {
+         decode(msg);
+      }
+   }
+};
+
+} // namespace detail
+
+/**
+ * @brief A work queue whose packets are values of type T.
+ *
+ * T must be trivially copyable, its bytes are the packet, so typed and C
+ * producers and consumers can share a keyed queue. A std::unique_ptr<U>
+ * is also accepted on private queues: the pointer travels instead, and
+ * whatever is still queued is deleted with the queue.
+ */
+template<class T>
+class work_queue
+{
+public:
+   typedef detail::codec<T> codec_type;
+
+   /**
+    * @brief Create a work queue, see workq_init().
+    *
+    * @param keyfile a filename to generate a key from, NULL for a private queue
+    * @param subsystem_id subsystem (for use with multiple queues)
+    */
+   explicit work_queue(const char *keyfile = NULL, int subsystem_id = 0)
+      : queue_(NULL)
+   {
+      if(codec_type::owning && keyfile) {
+         errno = EINVAL;
+         detail::throw_errno("work_queue: pointers only travel on private queues");
+      }
+
+      queue_ = workq_init(keyfile, subsystem_id);
+      if(!queue_) {
+         detail::throw_errno("workq_init");
+      }
+   }
+
+   ~work_queue()
+   {
+      reset();
+   }
+
+   work_queue(work_queue &&other) noexcept
+      : queue_(other.queue_)
+   {
+      other.queue_ = NULL;
+   }
+
+   work_queue &operator=(work_queue &&other) noexcept
+   {
+      if(this != &other) {
+         reset();
+         queue_ = other.queue_;
+         other.queue_ = NULL;
+      }
+      return *this;
+   }
+
+   work_queue(const work_queue &) = delete;
+   work_queue &operator=(const work_queue &) = delete;
+
+   /**
+    * @brief Add a value, see workq_add().
+    *
+    * @param value the value, moved in for owning types
+    * @param prio the packet priority
+    */
+   template<class V>
+   void push(V &&value, long prio = WORKQ_LOWEST_PRIO)
+   {
+      if(codec_type::send(queue_, std::forward<V>(value), prio)) {
+         detail::throw_errno("workq_add");
+      }
+   }
+
+   /**
+    * @brief Take the next value, blocking until there is one.
+    *
+    * return the value
+    */
+   T pop()
+   {
+      workq_msg_t msg;
+      ssize_t size = workq_get(queue_, &msg);
+
+      if(size < 0) {
+         detail::throw_errno("workq_get");
+      }
+      if(!codec_type::fits(size)) {
+         errno = EMSGSIZE;
+         detail::throw_errno("work_queue::pop");
+      }
+      return codec_type::decode(msg);
+   }
+
+   /**
+    * @brief Take the next value if there is one, see workq_try_get().
+    *
+    * @param out filled in with the value
+    *
+    * return true if a value was taken
+    */
+   bool try_pop(T &out)
+   {
+      workq_msg_t msg;
+      ssize_t size = workq_try_get(queue_, &msg);
+
+      if(size < 0) {
+         if(errno == ENOMSG || errno == EBUSY) {
+            return false;
+         }
+         detail::throw_errno("workq_try_get");
+      }
+      if(!codec_type::fits(size)) {
+         errno = EMSGSIZE;
+         detail::throw_errno("work_queue::try_pop");
+      }
+      out = codec_type::decode(msg);
+      return true;
+   }
+
+   /** The underlying C queue, still owned by this object. */
+   WorkQ_t native_handle() const noexcept
+   {
+      return queue_;
+   }
+
+private:
+   void reset() noexcept
+   {
+      workq_msg_t msg;
+      ssize_t size;
+
+      if(!queue_) {
+         return;
+      }
+
+      /* Owned objects still queued would leak with the queue. */
+      if(codec_type::owning) {
+         while((size = workq_try_get(queue_, &msg)) >= 0) {
+            codec_type::discard(msg, size);
+         }
+      }
+
+      workq_destroy(queue_);
+      queue_ = NULL;
+   }
+
+   WorkQ_t queue_;
+};
+
+/**
+ * @brief A move only void() callable.
+ *
+ * Callables up to inline_size bytes that can be moved without throwing
+ * are stored in the task itself, so the usual lambda capturing a few
+ * pointers or values never allocates. Larger ones go to the heap.
+ */
+class task
+{
+public:
+   static const std::size_t inline_size = 6 * sizeof(void *);
+
+   task() noexcept
+      : ops_(NULL)
+   {
+   }
+
+   template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type>
+   task(F &&fn)
+      : ops_(NULL)
+   {
+      typedef typename std::decay<F>::type callable;
+
+      construct<callable>(std::forward<F>(fn), std::integral_constant<bool, fits_inline<callable>::value>());
+   }
+
+   task(task &&other) noexcept
+      : ops_(other.ops_)
+   {
+      if(ops_) {
+         ops_->move(&storage_, &other.storage_);
+         other.ops_ = NULL;
+      }
+   }
+
+   task &operator=(task &&other) noexcept
+   {
+      if(this != &other) {
+         reset();
+         if(other.ops_) {
+            other.ops_->move(&storage_, &other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = NULL;
+         }
+      }
+      return *this;
+   }
+
+   task(const task &) = delete;
+   task &operator=(const task &) = delete;
+
+   ~task()
+   {
+      reset();
+   }
+
+   /** Run the callable. The task must not be empty. */
+   void operator()()
+   {
+      ops_->invoke(&storage_);
+   }
+
+   explicit operator bool() const noexcept
+   {
+      return ops_ != NULL;
+   }
+
+   /** Whether the callable is stored in the task rather than the heap. */
+   bool is_inline() const noexcept
+   {
+      return ops_ && ops_->is_inline;
+   }
+
+   /** Destroy the callable, leaving the task empty. */
+   void reset() noexcept
+   {
+      if(ops_) {
+         ops_->destroy(&storage_);
+         ops_ = NULL;
+      }
+   }
+
+private:
+   typedef typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type storage_type;
+
+   struct ops_type
+   {
+      void (*invoke)(void *);
+      void (*move)(void *, void *) noexcept;
+      void (*destroy)(void *) noexcept;
+      bool is_inline;
+   };
+
+   template<class F>
+   struct fits_inline : std::integral_constant<bool,
+         sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) &&
+         std::is_nothrow_move_constructible<F>::value>
+   {
+   };
+
+   template<class F>
+   struct inline_ops
+   {
+      static void invoke(void *p)
+      {
+         (*static_cast<F *>(p))();
+      }
+
+      static void move(void *dst, void *src) noexcept
+      {
+         ::new(dst) F(std::move(*static_cast<F *>(src)));
+         static_cast<F *>(src)->~F();
+      }
+
+      static void destroy(void *p) noexcept
+      {
+         static_cast<F *>(p)->~F();
+      }
+
+      static const ops_type table;
+   };
+
+   template<class F>
+   struct heap_ops
+   {
+      static void invoke(void *p)
+      {
+         (**static_cast<F **>(p))();
+      }
+
+      static void move(void *dst, void *src) noexcept
+      {
+         *static_cast<F **>(dst) = *static_cast<F **>(src);
+      }
+
+      static void destroy(void *p) noexcept
+      {
+         delete *static_cast<F **>(p);
+      }
+
+      static const ops_type table;
+   };
+
+   template<class F, class A>
+   void construct(A &&fn, std::true_type)
+   {
+      ::new(&storage_) F(std::forward<A>(fn));
+      ops_ = &inline_ops<F>::table;
+   }
+
+   template<class F, class A>
+   void construct(A &&fn, std::false_type)
+   {
+      *reinterpret_cast<F **>(&storage_) = new F(std::forward<A>(fn));
+      ops_ = &heap_ops<F>::table;
+   }
+
+   storage_type storage_;
+   const ops_type *ops_;
+};
+
+template<class F>
+const task::ops_type task::inline_ops<F>::table = { &invoke, &move, &destroy, true };
+
+template<class F>
+const task::ops_type task::heap_ops<F>::table = { &invoke, &move, &destroy, false };
+
+/**
+ * @brief Owns a ThreadPool_t.
+ *
+ * Workers call the function over and over, like thread_pool_create().
+ * The pool is deleted with the object, which blocks until every worker
+ * is done. Functions must not throw.
+ */
+class pool
+{
+public:
+   /**
+    * @brief Create a pool, see thread_pool_create_ex().
+    *
+    * @param num_threads number of threads in the pool
+    * @param fn callable run by each thread, copied into the pool
+    * @param attr pool attributes, or NULL for the defaults
+    */
+   template<class F>
+   pool(unsigned int num_threads, F &&fn, const thread_pool_attr_t *attr = NULL)
+      : pool_(NULL)
+   {
+      void *arg = keep(std::forward<F>(fn));
+
+      pool_ = thread_pool_create_ex(num_threads, &trampoline<typename std::decay<F>::type>, arg, attr);
+      if(!pool_) {
+         detail::throw_errno("thread_pool_create");
+      }
+   }
+
+   ~pool()
+   {
+      thread_pool_delete(pool_);
+   }
+
+   pool(pool &&other) noexcept
+      : pool_(other.pool_), functions_(std::move(other.functions_))
+   {
+      other.pool_ = NULL;
+   }
+
+   pool(const pool &) = delete;
+   pool &operator=(const pool &) = delete;
+   pool &operator=(pool &&) = delete;
+
+   /** Add threads to the default group, see thread_pool_add(). */
+   void add(unsigned int num_to_add)
+   {
+      if(thread_pool_add(pool_, num_to_add, NULL) != BOOLEAN_TRUE) {
+         detail::throw_errno("thread_pool_add");
+      }
+   }
+
+   /** Trim the default group, see thread_pool_trim(). */
+   void trim(unsigned int num_to_cut)
+   {
+      thread_pool_trim(pool_, num_to_cut);
+   }
+
+   /** Threads in the pool, see thread_pool_get_pool_size(). */
+   unsigned int size() const
+   {
+      return thread_pool_get_pool_size(pool_);
+   }
+
+   /**
+    * @brief Add a worker group, see thread_pool_group_create().
+    *
+    * return the group number
+    */
+   template<class F>
+   unsigned int add_group(const char *name, unsigned int num_threads, F &&fn)
+   {
+      void *arg = keep(std::forward<F>(fn));
+      int group = thread_pool_group_create(pool_, name, num_threads, &trampoline<typename std::decay<F>::type>, arg, NULL);
+
+      if(group < 0) {
+         detail::throw_errno("thread_pool_group_create");
+      }
+      return group;
+   }
+
+   /** The underlying C pool, still owned by this object. */
+   ThreadPool_t native_handle() const noexcept
+   {
+      return pool_;
+   }
+
+private:
+   typedef std::unique_ptr<void, void (*)(void *)> function_holder;
+
+   template<class F>
+   static void *trampoline(void *arg) noexcept
+   {
+      (*static_cast<F *>(arg))();
+      return NULL;
+   }
+
+   template<class F>
+   static void destroy(void *p)
+   {
+      delete static_cast<F *>(p);
+   }
+
+   /* Functions live until the pool is gone, the workers point at them. */
+   template<class F>
+   void *keep(F &&fn)
+   {
+      typedef typename std::decay<F>::type callable;
+
+      functions_.reserve(functions_.size() + 1);
+      functions_.push_back(function_holder(new callable(std::forward<F>(fn)), &destroy<callable>));
+      return functions_.back().get();
+   }
+
+   ThreadPool_t pool_;
+   std::vector<function_holder> functions_;
+};
+
+/**
+ * @brief A pool running submitted tasks.
+ *
+ * Tasks wait in a fixed size in-process ring, so submitting a small
+ * closure allocates nothing. The pool's threads each run one task per
+ * call of their run function, as the C pool expects. Tasks must not throw.
+ */
+class task_pool
+{
+public:
+   /**
+    * @brief Start the pool.
+    *
+    * @param num_threads number of threads in the pool
+    * @param capacity tasks that can wait before submit() blocks
+    */
+   explicit task_pool(unsigned int num_threads, std::size_t capacity = 1024)
+      : ring_(capacity ? capacity : 1), head_(0), count_(0), running_(0), stopping_(false),
+        pool_(num_threads, runner(this))
+   {
+   }
+
+   /** Runs everything submitted so far, then stops the threads. */
+   ~task_pool()
+   {
+      std::unique_lock<std::mutex> lock(lock_);
+
+      idle_.wait(lock, [this] { return !count_ && !running_; });
+      stopping_ = true;
+      not_empty_.notify_all();
+   }
+
+   task_pool(const task_pool &) = delete;
+   task_pool &operator=(const task_pool &) = delete;
+
+   /**
+    * @brief Queue a callable, blocking while the ring is full.
+    *
+    * @param fn the callable, moved into the ring
+    */
+   template<class F>
+   void submit(F &&fn)
+   {
+      std::unique_lock<std::mutex> lock(lock_);
+
+      not_full_.wait(lock, [this] { return count_ < ring_.size(); });
+      ring_[(head_ + count_) % ring_.size()] = task(std::forward<F>(fn));
+      count_++;
+      lock.unlock();
+      not_empty_.notify_one();
+   }
+
+   /** Block until every submitted task has run. */
+   void wait()
+   {
+      std::unique_lock<std::mutex> lock(lock_);
+
+      idle_.wait(lock, [this] { return !count_ && !running_; });
+   }
+
+   /** Threads in the pool. */
+   unsigned int size() const
+   {
+      return pool_.size();
+   }
+
+private:
+   struct runner
+   {
+      task_pool *owner;
+
+      explicit runner(task_pool *p)
+         : owner(p)
+      {
+      }
+
+      void operator()()
+      {
+         owner->run_one();
+      }
+   };
+
+   void run_one()
+   {
+      task next;
+      std::unique_lock<std::mutex> lock(lock_);
+
+      not_empty_.wait(lock, [this] { return count_ || stopping_; });
+      if(!count_) {
+         /* Stopping, the pool is about to be deleted. */
+         return;
+      }
+
+      next = std::move(ring_[head_]);
+      head_ = (head_ + 1) % ring_.size();
+      count_--;
+      running_++;
+      lock.unlock();
+      not_full_.notify_one();
+
+      next();
+      next.reset();
+
+      lock.lock();
+      if(!--running_ && !count_) {
+         idle_.notify_all();
+      }
+   }
+
+   std::mutex lock_;
+   std::condition_variable not_empty_;
+   std::condition_variable not_full_;
+   std::condition_variable idle_;
+   std::vector<task> ring_;
+   std::size_t head_;
+   std::size_t count_;
+   std::size_t running_;
+   bool stopping_;
+
+   /* Last, so the threads are gone before the ring and locks. */
+   pool pool_;
+};
+
+} // namespace thread_pool
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,190 @@
+/*
+ * trace.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#ifdef THREAD_POOL_TRACE
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Events kept per thread, must be a power of two. */
+#define TRACE_RING_SIZE (16 * 1024)
+
+typedef struct trace_rec_t
+{
+   uint64_t ts_ns;
+   uint64_t id;
+   uint32_t type;
+} trace_rec_t;
+
+/* One per thread. Only the owner writes, the head is published after the event. */
+typedef struct trace_ring_t
+{
+   struct trace_ring_t *next;
+   long tid;
+   uint64_t head;
+   trace_rec_t recs[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = NULL;
+static uint64_t trace_ids = 0;
+
+static __thread trace_ring_t *trace_ring = NULL;
+static __thread uint64_t trace_dequeued = 0;
+
+/* Rings outlive their threads, a trimmed worker's events still belong in the dump. */
+static trace_ring_t *_ring_for_thread(void)
+{
+   trace_ring_t *ring = calloc(1, sizeof(*ring));
+
+   if(!ring) {
+      return(NULL);
+   }
+
+   ring->tid = syscall(SYS_gettid);
+
+   pthread_mutex_lock(&trace_lock);
+   ring->next = trace_rings;
+   trace_rings = ring;
+   pthread_mutex_unlock(&trace_lock);
+
+   return(ring);
+}
+
+void trace_event(trace_type_t type, uint64_t id)
+{
+   trace_ring_t *ring = trace_ring;
+   trace_rec_t *rec;
+   struct timespec ts;
+
+   if(!ring) {
+      ring = trace_ring = _ring_for_thread();
+      if(!ring) {
+         return;
+      }
+   }
+
+   if(type == TRACE_DEQUEUE) {
+      trace_dequeued = id;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   rec = &ring->recs[ring->head & (TRACE_RING_SIZE - 1)];
+   rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+   rec->id = id;
+   rec->type = type;
+
+   __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t trace_new_id(void)
+{
+   /* The pid in the top bits keeps ids apart on queues shared between processes. */
+   return(((uint64_t)getpid() << 40) | (__sync_add_and_fetch(&trace_ids, 1) & ((1ULL << 40) - 1)));
+}
+
+uint64_t trace_last_dequeued(void)
+{
+   return(trace_dequeued);
+}
+
+int trace_dump(const char *filename)
+{
+   static const char *names[] = { "enqueue", "dequeue", "run", "run", "merge" };
+   static const char *flows[] = { "s", "f", "", "", "t" };
+   trace_ring_t *ring;
+   FILE *out;
+   int pid = getpid();
+   int first = 1;
+
+   out = fopen(filename, "w");
+   if(!out) {
+      return(-1);
+   }
+
+   fprintf(out, "{\"traceEvents\":[\n");
+
+   pthread_mutex_lock(&trace_lock);
+
+   for(ring = trace_rings; ring; ring = ring->next) {
+      uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      uint64_t x = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+      for( ; x < head; ++x) {
+         trace_rec_t *rec = &ring->recs[x & (TRACE_RING_SIZE - 1)];
+         double ts = rec->ts_ns / 1000.0;
+
+         fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"thread_pool\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f",
+               first ? "" : ",\n", names[rec->type], pid, ring->tid, ts);
+         first = 0;
+
+         switch(rec->type) {
+         case TRACE_RUN_BEGIN:
+            fprintf(out, ",\"ph\":\"B\",\"args\":{\"packet\":%llu}}", (unsigned long long)rec->id);
+            break;
+
+         case TRACE_RUN_END:
+            fprintf(out, ",\"ph\":\"E\"}");
+            break;
+
+         default:
+            /* Instant event plus a point on the flow arrow between the threads. */
+            fprintf(out, ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"packet\":%llu}}", (unsigned long long)rec->id);
+            if(rec->id) {
+               fprintf(out, ",\n{\"name\":\"packet\",\"cat\":\"thread_pool\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"id\":%llu,\"ph\":\"%s\"%s}",
+                     pid, ring->tid, ts, (unsigned long long)rec->id, flows[rec->type],
+                     rec->type == TRACE_ENQUEUE ? "" : ",\"bp\":\"e\"");
+            }
+            break;
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&trace_lock);
+
+   fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+   if(fclose(out)) {
+      return(-1);
+   }
+
+   return(0);
+}
+
+#else /* THREAD_POOL_TRACE */
+
+int trace_dump(const char *filename)
+{
+   errno = ENOSYS;
+   return(-1);
+}
+
+#endif /* THREAD_POOL_TRACE */
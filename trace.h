@@ -0,0 +1,93 @@
+/*
+ * trace.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdint.h>
+
+/** Trace event types. */
+typedef enum {
+   TRACE_ENQUEUE = 0, /**< Packet added to a work queue. */
+   TRACE_DEQUEUE, /**< Packet handed out by a work queue. */
+   TRACE_RUN_BEGIN, /**< Pool thread entered its run function. */
+   TRACE_RUN_END, /**< Pool thread returned from its run function. */
+   TRACE_MERGE, /**< Keyed packet merged into a pending one. */
+} trace_type_t;
+
+#ifdef THREAD_POOL_TRACE
+
+/**
+ * @brief Record an event in the calling thread's trace buffer.
+ *
+ * Each thread writes only to its own ring buffer, so recording takes no
+ * locks. Once a ring is full the oldest events are overwritten.
+ *
+ * @param type the event type
+ * @param id the packet the event belongs to, 0 for none
+ */
+void trace_event(trace_type_t type, uint64_t id);
+
+/**
+ * @brief Get an id to follow a packet from queue to worker.
+ *
+ * return an id unique across processes
+ */
+uint64_t trace_new_id(void);
+
+/**
+ * @brief Get the packet the calling thread last dequeued.
+ *
+ * return the id of the calling thread's last TRACE_DEQUEUE event, 0 for none
+ */
+uint64_t trace_last_dequeued(void);
+
+#define TRACE_EVENT(_type, _id) trace_event(_type, _id)
+#define TRACE_NEW_ID() trace_new_id()
+#define TRACE_LAST_DEQUEUED() trace_last_dequeued()
+
+#else /* THREAD_POOL_TRACE */
+
+#define TRACE_EVENT(_type, _id) do { } while(0)
+#define TRACE_NEW_ID() (0)
+#define TRACE_LAST_DEQUEUED() (0)
+
+#endif /* THREAD_POOL_TRACE */
+
+/**
+ * @brief Write every thread's trace buffer to a file.
+ *
+ * The file is Chrome trace event JSON, which chrome://tracing and
+ * Perfetto open directly. Packets show up as flows from the enqueueing
+ * thread to the worker that picked them up, through any merges.
+ *
+ * Only does anything when built with THREAD_POOL_TRACE. Events recorded
+ * while the dump runs may be torn; dump once the pool is quiet.
+ *
+ * @param filename the file to write
+ *
+ * return zero on success, anything else is failure (errno is set)
+ */
+int trace_dump(const char *filename);
+
+#endif /* TRACE_H */
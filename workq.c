@@ -30,26 +30,221 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 
 #include "workq.h"
+#include "journal.h"
+#include "trace.h"
 
 #define WORKQ_MAGIC (0x57726b51)
 
+/* Polls between clock reads while spinning. */
+#define WORKQ_SPIN_CHECK (64)
+
+/* Tell the CPU we're in a spin loop, saves power and the pipeline flush on exit. */
+#if defined(__i386__) || defined(__x86_64__)
+#define WORKQ_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define WORKQ_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define WORKQ_CPU_RELAX() do { } while(0)
+#endif
+
+/* Coalescing index size. Stripes share locks between buckets. */
+#define WORKQ_INDEX_BUCKETS (1024)
+#define WORKQ_INDEX_STRIPES (64)
+
+/* Header flags. */
+#define WQ_HDR_KEYED (0x1) /* Payload is in the coalescing index, not the message. */
+#define WQ_HDR_JOURNALED (0x2) /* Payload is in the journal, not the message. */
+
+/* Journal defaults */
+#define WORKQ_JOURNAL_SEGMENT (4 * 1024 * 1024)
+#define WORKQ_JOURNAL_SYNC_EVERY (64)
+#define WORKQ_JOURNAL_SYNC_MS (10)
+
+/* Handle slot states */
+#define WQ_HANDLE_FREE (0)
+#define WQ_HANDLE_PENDING (1)
+#define WQ_HANDLE_CANCELLED (2)
+
+/* Internal header carried in front of every payload on the SysV queue. */
+typedef struct wq_hdr_t {
+	uint32_t flags;
+	uint32_t reserved;
+	long key;
+	journal_loc_t loc;
+	uint64_t deadline_ns; /* CLOCK_REALTIME, so it means the same in every process. */
+	workq_handle_t handle;
+	uint64_t trace_id; /* Always there, so traced and untraced builds can share a queue. */
+} wq_hdr_t;
+
+/*
+ * A handle is a slot number and the slot's generation, so a handle for
+ * a packet that's already gone never matches the slot's next packet.
+ */
+typedef struct wq_handle_slot_t {
+	uint32_t gen;
+	uint32_t state;
+	uint32_t next_free;
+} wq_handle_slot_t;
+
+/* What actually goes through the SysV queue. */
+typedef struct wq_msg_t {
+	long type;
+	wq_hdr_t hdr;
+	unsigned char data[WORKQ_MAX_SIZE];
+} wq_msg_t;
+
+/*
+ * A pending keyed packet. Allocated for its payload only, a storm of
+ * small keys shouldn't cost a full packet each. Grows when a merge does.
+ */
+typedef struct wq_entry_t {
+	struct wq_entry_t *next;
+	long key;
+	uint64_t trace_id; /* The token's, merges are traced against it. */
+	size_t size;
+	size_t capacity;
+	unsigned char data[];
+} wq_entry_t;
+
+typedef struct wq_index_t {
+	workq_merge_t merge;
+	pthread_mutex_t stripes[WORKQ_INDEX_STRIPES];
+	wq_entry_t *buckets[WORKQ_INDEX_BUCKETS];
+} wq_index_t;
+
 typedef struct wq_t {
 	uint32_t magic;
 	int id;
 	key_t key;
 	pthread_mutex_t mutex;
 	pthread_mutex_t send_mutex;
+	wq_index_t *index;
+	Journal_t journal;
+	pthread_mutex_t handle_mutex;
+	wq_handle_slot_t *handles;
+	uint32_t num_handles;
+	uint32_t free_handle; /* Index + 1 of the first free slot, 0 if none. */
+	pthread_t replay_thread;
+	int replaying;
+	journal_pending_t *pending;
+	ssize_t num_pending;
+	workq_stats_t stats; /* Updated with atomic builtins, the counters straddle both mutexes. */
+	/* A consumer holds mutex while it waits, so the policy has its own lock. */
+	pthread_mutex_t policy_mutex;
+	workq_wait_t wait_policy;
+	uint64_t spin_ns;
+	unsigned int policy_gen; /* Bumped on every change, consumers poll it with atomic builtins. */
+	/* Everything below is protected by mutex. */
+	unsigned int seen_gen;
+	workq_wait_t cur_policy; /* The consumers' copy of the policy as of seen_gen. */
+	uint64_t cur_spin_ns;
+	uint64_t arrival_ns; /* Average time between packets, for WORKQ_WAIT_ADAPTIVE. */
+	uint64_t last_get_ns;
 } wq_t;
 
-WorkQ_t workq_init(const char *keyfile, int subsystem_id) {
+#define WQ_STAT_INC(_q, _counter) __sync_fetch_and_add(&((_q)->stats._counter), 1)
+
+static uint64_t _now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint64_t _wall_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Returns 0 if the table can't grow or the queue is gone (errno is set). */
+static workq_handle_t _handle_alloc(wq_t *q) {
+	wq_handle_slot_t *slot;
+	workq_handle_t handle;
+	uint32_t index;
+
+	pthread_mutex_lock(&(q->handle_mutex));
+
+	/* Don't grow a table workq_destroy() already freed. */
+	if(q->magic != WORKQ_MAGIC) {
+		pthread_mutex_unlock(&(q->handle_mutex));
+		errno = ENODEV;
+		return(0);
+	}
+
+	if(!q->free_handle) {
+		uint32_t x;
+		uint32_t num = q->num_handles ? q->num_handles * 2 : 64;
+		wq_handle_slot_t *handles = realloc(q->handles, num * sizeof(*handles));
+
+		if(!handles) {
+			pthread_mutex_unlock(&(q->handle_mutex));
+			errno = ENOMEM;
+			return(0);
+		}
+
+		for(x = q->num_handles; x < num; ++x) {
+			handles[x].gen = 1;
+			handles[x].state = WQ_HANDLE_FREE;
+			handles[x].next_free = (x + 1 < num) ? x + 2 : 0;
+		}
+
+		q->free_handle = q->num_handles + 1;
+		q->handles = handles;
+		q->num_handles = num;
+	}
+
+	index = q->free_handle - 1;
+	slot = &(q->handles[index]);
+	q->free_handle = slot->next_free;
+	slot->state = WQ_HANDLE_PENDING;
+
+	/* Another thread may realloc() the slots as soon as the lock is dropped. */
+	handle = ((workq_handle_t)slot->gen << 32) | index;
+
+	pthread_mutex_unlock(&(q->handle_mutex));
+
+	return(handle);
+}
+
+/* Frees the handle's slot. Returns the state the packet was in. */
+static uint32_t _handle_release(wq_t *q, workq_handle_t handle) {
+	uint32_t index = (uint32_t)handle;
+	uint32_t state = WQ_HANDLE_FREE;
+	wq_handle_slot_t *slot;
+
+	pthread_mutex_lock(&(q->handle_mutex));
+
+	if(index < q->num_handles && q->handles[index].gen == (uint32_t)(handle >> 32)) {
+		slot = &(q->handles[index]);
+		state = slot->state;
+		slot->state = WQ_HANDLE_FREE;
+		/* Generation zero would make handle zero, which means no handle. */
+		if(!++slot->gen) {
+			slot->gen = 1;
+		}
+		slot->next_free = q->free_handle;
+		q->free_handle = index + 1;
+	}
+
+	pthread_mutex_unlock(&(q->handle_mutex));
+
+	return(state);
+}
+
+/* Sets *created if the SysV queue didn't exist before, meaning nobody else is using it. */
+static wq_t *_workq_open(const char *keyfile, int subsystem_id, int *created) {
 	wq_t *q;
 
 	q = calloc(1, sizeof(wq_t));
@@ -61,6 +256,8 @@ WorkQ_t workq_init(const char *keyfile, int subsystem_id) {
 
 	pthread_mutex_init(&(q->mutex), NULL);
 	pthread_mutex_init(&(q->send_mutex), NULL);
+	pthread_mutex_init(&(q->handle_mutex), NULL);
+	pthread_mutex_init(&(q->policy_mutex), NULL);
 
 	if(keyfile) {
 		q->key = ftok(keyfile, subsystem_id);
@@ -68,23 +265,182 @@ WorkQ_t workq_init(const char *keyfile, int subsystem_id) {
 		q->key = IPC_PRIVATE;
 	}
 
-	q->id = msgget(q->key, 0660);
+	*created = 0;
 
 	/* Try to attach to existing queue first */
-	if(q->id > 0) {
-		return((WorkQ_t)q);
+	if(q->key != IPC_PRIVATE) {
+		q->id = msgget(q->key, 0660);
+		if(q->id >= 0) {
+			return(q);
+		}
+	}
+
+	/* Try to create a queue, unless someone beat us to it */
+	q->id = msgget(q->key, IPC_CREAT | IPC_EXCL | 0660);
+	if(q->id >= 0) {
+		*created = 1;
+		return(q);
+	}
+
+	if(errno == EEXIST) {
+		q->id = msgget(q->key, 0660);
+		if(q->id >= 0) {
+			return(q);
+		}
+	}
+
+	q->magic = 0;
+	free(q);
+	return(NULL);
+}
+
+WorkQ_t workq_init(const char *keyfile, int subsystem_id) {
+	int created;
+
+	return((WorkQ_t)_workq_open(keyfile, subsystem_id, &created));
+}
+
+static int _send(wq_t *q, const wq_msg_t *wmsg, size_t size);
+
+/*
+ * Puts the recovered packets back on the queue. It's a thread because a
+ * fresh SysV queue only holds a few KiB and there may be far more than
+ * that in the journal, so this blocks until consumers make room.
+ */
+static void *_replay(void *arg) {
+	ssize_t x;
+	wq_msg_t wmsg;
+	wq_t *q = (wq_t*)arg;
+
+	memset(&wmsg, 0, sizeof(wmsg.type) + sizeof(wmsg.hdr));
+	wmsg.hdr.flags = WQ_HDR_JOURNALED;
+
+	for(x = 0; x < q->num_pending; ++x) {
+		wmsg.type = q->pending[x].prio;
+		wmsg.hdr.loc = q->pending[x].loc;
+		wmsg.hdr.trace_id = TRACE_NEW_ID();
+
+		/* Fails once the queue is destroyed. */
+		TRACE_EVENT(TRACE_ENQUEUE, wmsg.hdr.trace_id);
+		if(_send(q, &wmsg, 0)) {
+			break;
+		}
+		journal_commit(q->journal, wmsg.hdr.loc);
+	}
+
+	free(q->pending);
+	q->pending = NULL;
+
+	return(NULL);
+}
+
+WorkQ_t workq_init_journaled(const char *keyfile, int subsystem_id, const char *journal_dir, const workq_journal_opts_t *opts) {
+	wq_t *q;
+	int created;
+	size_t segment_size = WORKQ_JOURNAL_SEGMENT;
+	unsigned int sync_every = WORKQ_JOURNAL_SYNC_EVERY;
+	unsigned long sync_ms = WORKQ_JOURNAL_SYNC_MS;
+
+	/* A private queue is always new, so every open would replay the journal. */
+	if(!journal_dir || !keyfile) {
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	if(opts) {
+		segment_size = opts->segment_size ? opts->segment_size : segment_size;
+		sync_every = opts->sync_every ? opts->sync_every : sync_every;
+		sync_ms = opts->sync_interval_ms ? opts->sync_interval_ms : sync_ms;
+	}
+
+	q = _workq_open(keyfile, subsystem_id, &created);
+	if(!q) {
+		return(NULL);
+	}
+
+	/* A queue that had to be created has lost whatever was on it, the
+	 * journal has it. One that already existed still holds its packets.
+	 */
+	q->journal = journal_open(journal_dir, segment_size, sync_every, sync_ms * 1000000ULL, created);
+	if(!q->journal) {
+		goto fail;
+	}
+
+	/* Otherwise only the packets whose producer died before sending them are missing. */
+	if(created) {
+		q->num_pending = journal_pending(q->journal, &(q->pending));
+	} else {
+		q->num_pending = journal_uncommitted(q->journal, &(q->pending));
+	}
+
+	if(q->num_pending < 0) {
+		goto fail;
 	}
 
-	/* Try to create a queue */
-	if(msgget(q->key, IPC_CREAT | 0660) > 0) {
-		return((WorkQ_t)q);
+	if(q->num_pending) {
+		if(pthread_create(&(q->replay_thread), NULL, _replay, q)) {
+			goto fail;
+		}
+		q->replaying = 1;
+	} else {
+		free(q->pending);
+		q->pending = NULL;
 	}
 
+	return((WorkQ_t)q);
+
+fail:
+	free(q->pending);
+	journal_close(q->journal);
+	if(created) {
+		msgctl(q->id, IPC_RMID, NULL);
+	}
 	q->magic = 0;
 	free(q);
 	return(NULL);
 }
 
+/* Drops every pending entry. The index itself stays usable. */
+static void _index_clear(wq_index_t *index) {
+	unsigned int x;
+
+	for(x = 0; x < WORKQ_INDEX_BUCKETS; ++x) {
+		pthread_mutex_t *stripe = &(index->stripes[x % WORKQ_INDEX_STRIPES]);
+		wq_entry_t *entry;
+
+		pthread_mutex_lock(stripe);
+		entry = index->buckets[x];
+		index->buckets[x] = NULL;
+		pthread_mutex_unlock(stripe);
+
+		while(entry) {
+			wq_entry_t *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+}
+
+static void _index_free(wq_index_t *index) {
+	unsigned int x;
+
+	for(x = 0; x < WORKQ_INDEX_BUCKETS; ++x) {
+		wq_entry_t *entry = index->buckets[x];
+
+		while(entry) {
+			wq_entry_t *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+
+	for(x = 0; x < WORKQ_INDEX_STRIPES; ++x) {
+		pthread_mutex_destroy(&(index->stripes[x]));
+	}
+
+	free(index);
+}
+
 int workq_destroy(WorkQ_t work_queue) {
 	int rv = -1;
 	wq_t *q = (wq_t*)work_queue;
@@ -94,15 +450,332 @@ int workq_destroy(WorkQ_t work_queue) {
 		return(-1);
 	}
 
+	/* Consumers woken out of msgrcv() still unlock the mutex, and the ones
+	 * queued behind them still lock it, so it is never destroyed.
+	 */
 	rv = msgctl(q->id, IPC_RMID, NULL);
 	q->magic = 0;
-	pthread_mutex_destroy(&(q->mutex));
+
+	if(q->replaying) {
+		pthread_join(q->replay_thread, NULL);
+		q->replaying = 0;
+	}
+
+	if(q->journal) {
+		journal_close(q->journal);
+		q->journal = NULL;
+	}
+
+	/* Consumers woken by the removal may still be releasing their handles. */
+	pthread_mutex_lock(&(q->handle_mutex));
+	free(q->handles);
+	q->handles = NULL;
+	q->num_handles = 0;
+	q->free_handle = 0;
+	pthread_mutex_unlock(&(q->handle_mutex));
+
+	/* Like the queue object, the index outlives a destroy: consumers still
+	 * in _deliver() and producers in workq_add_keyed() keep using its
+	 * stripes. Only the pending payloads go.
+	 */
+	if(q->index) {
+		_index_clear(q->index);
+	}
 
 	return(rv);
 }
 
+int workq_set_coalesce(WorkQ_t work_queue, workq_merge_t merge) {
+	unsigned int x;
+	wq_index_t *index;
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	/* The index lives in this process, another one can't find the payloads.
+	 * A journaled queue has to get every payload into the journal.
+	 */
+	if(q->key != IPC_PRIVATE || q->journal) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	index = calloc(1, sizeof(*index));
+	if(!index) {
+		return(-1);
+	}
+
+	index->merge = merge;
+	for(x = 0; x < WORKQ_INDEX_STRIPES; ++x) {
+		pthread_mutex_init(&(index->stripes[x]), NULL);
+	}
+
+	/* Only one index per queue, the first one wins. */
+	if(!__sync_bool_compare_and_swap(&(q->index), NULL, index)) {
+		_index_free(index);
+		errno = EBUSY;
+		return(-1);
+	}
+
+	return(0);
+}
+
+int workq_get_stats(WorkQ_t work_queue, workq_stats_t *stats) {
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	stats->added = __sync_fetch_and_add(&(q->stats.added), 0);
+	stats->delivered = __sync_fetch_and_add(&(q->stats.delivered), 0);
+	stats->coalesced = __sync_fetch_and_add(&(q->stats.coalesced), 0);
+	stats->cancelled = __sync_fetch_and_add(&(q->stats.cancelled), 0);
+	stats->expired = __sync_fetch_and_add(&(q->stats.expired), 0);
+
+	return(0);
+}
+
+int workq_set_wait_policy(WorkQ_t work_queue, workq_wait_t policy, unsigned long spin_ns) {
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(policy > WORKQ_WAIT_ADAPTIVE) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	/* Not the queue mutex, a consumer holds it for as long as it waits.
+	 * Spinning consumers see the new generation on their next poll,
+	 * parked ones once they wake up.
+	 */
+	pthread_mutex_lock(&(q->policy_mutex));
+	q->wait_policy = policy;
+	q->spin_ns = spin_ns;
+	__sync_add_and_fetch(&(q->policy_gen), 1);
+	pthread_mutex_unlock(&(q->policy_mutex));
+
+	return(0);
+}
+
+static unsigned int _bucket_of(long key) {
+	uint64_t h = (uint64_t)key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return((unsigned int)(h % WORKQ_INDEX_BUCKETS));
+}
+
+/* Unlink the pending entry for key, if there is one. */
+static wq_entry_t *_index_take(wq_index_t *index, long key) {
+	unsigned int bucket = _bucket_of(key);
+	pthread_mutex_t *stripe = &(index->stripes[bucket % WORKQ_INDEX_STRIPES]);
+	wq_entry_t **link;
+	wq_entry_t *entry = NULL;
+
+	pthread_mutex_lock(stripe);
+	for(link = &(index->buckets[bucket]); *link; link = &((*link)->next)) {
+		if((*link)->key == key) {
+			entry = *link;
+			*link = entry->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(stripe);
+
+	return(entry);
+}
+
+static ssize_t _recv(wq_t *q, wq_msg_t *wmsg, int flags) {
+	return(msgrcv(q->id, wmsg, sizeof(wmsg->hdr) + sizeof(wmsg->data), -WORKQ_LOWEST_PRIO, flags));
+}
+
+/* WARNING: Only called with the queue mutex held. Returns non-zero if the policy changed since the last call. */
+static int _policy_changed(wq_t *q) {
+	return(__sync_fetch_and_add(&(q->policy_gen), 0) != q->seen_gen);
+}
+
+/*
+ * WARNING: Only called with the queue mutex held.
+ * Takes up a new wait policy, starting the adaptive average over.
+ */
+static void _load_policy(wq_t *q) {
+	if(!_policy_changed(q)) {
+		return;
+	}
+
+	pthread_mutex_lock(&(q->policy_mutex));
+	q->cur_policy = q->wait_policy;
+	q->cur_spin_ns = q->spin_ns;
+	q->seen_gen = q->policy_gen;
+	pthread_mutex_unlock(&(q->policy_mutex));
+
+	q->arrival_ns = 0;
+	q->last_get_ns = 0;
+}
+
+/*
+ * WARNING: Only called with the queue mutex held.
+ *
+ * SysV queues have no userspace fast path, so each poll is still a
+ * msgrcv() syscall, but one that returns right away instead of putting
+ * the thread to sleep and paying for the wakeup.
+ *
+ * Gives up with EAGAIN as soon as the wait policy changes.
+ */
+static ssize_t _spin_get(wq_t *q, wq_msg_t *wmsg, uint64_t budget_ns) {
+	ssize_t rcv_size;
+	uint64_t deadline = 0;
+	unsigned int polls = 0;
+
+	if(budget_ns) {
+		deadline = _now_ns() + budget_ns;
+	}
+
+	while(1) {
+		rcv_size = _recv(q, wmsg, IPC_NOWAIT);
+		if(rcv_size >= 0 || errno != ENOMSG) {
+			return(rcv_size);
+		}
+
+		WORKQ_CPU_RELAX();
+
+		if(_policy_changed(q)) {
+			errno = EAGAIN;
+			return(-1);
+		}
+
+		if(deadline && !(++polls % WORKQ_SPIN_CHECK) && _now_ns() >= deadline) {
+			errno = ENOMSG;
+			return(-1);
+		}
+	}
+}
+
+/* WARNING: Only called with the queue mutex held. Waits according to the queue's policy. */
+static ssize_t _wait_get(wq_t *q, wq_msg_t *wmsg) {
+	ssize_t rcv_size;
+	uint64_t budget_ns;
+	uint64_t now;
+
+	/* Starts over whenever the policy changes under a spinning consumer. */
+	do {
+		_load_policy(q);
+
+		rcv_size = -1;
+		budget_ns = 0;
+
+		switch(q->cur_policy) {
+		case WORKQ_WAIT_SPIN:
+			rcv_size = _spin_get(q, wmsg, 0);
+			continue;
+
+		case WORKQ_WAIT_ADAPTIVE:
+			/* Spinning for a packet that's a long way off just burns the CPU. */
+			if(q->arrival_ns && q->arrival_ns * 2 <= q->cur_spin_ns) {
+				budget_ns = q->arrival_ns * 2;
+			}
+			break;
+
+		case WORKQ_WAIT_SPIN_PARK:
+			budget_ns = q->cur_spin_ns;
+			break;
+
+		default:
+			break;
+		}
+
+		if(budget_ns) {
+			rcv_size = _spin_get(q, wmsg, budget_ns);
+			if(rcv_size < 0 && errno == EAGAIN) {
+				continue;
+			}
+		}
+
+		/* Wait for next message */
+		if(rcv_size < 0) {
+			rcv_size = _recv(q, wmsg, 0);
+		}
+	} while(rcv_size < 0 && errno == EAGAIN);
+
+	if(q->cur_policy == WORKQ_WAIT_ADAPTIVE && rcv_size >= 0) {
+		now = _now_ns();
+		if(q->last_get_ns) {
+			/* Moving average over roughly the last eight packets. */
+			q->arrival_ns = (q->arrival_ns * 7 + (now - q->last_get_ns)) / 8;
+		}
+		q->last_get_ns = now;
+	}
+
+	return(rcv_size);
+}
+
+/*
+ * Copy a received packet out to the caller. Returns the payload size,
+ * or -1 if there turned out to be nothing to deliver.
+ */
+static ssize_t _deliver(wq_t *q, wq_msg_t *wmsg, ssize_t rcv_size, workq_msg_t *msg) {
+	ssize_t size = rcv_size - sizeof(wmsg->hdr);
+	wq_entry_t *entry;
+	int drop = 0;
+
+	if(wmsg->hdr.handle && _handle_release(q, wmsg->hdr.handle) == WQ_HANDLE_CANCELLED) {
+		WQ_STAT_INC(q, cancelled);
+		drop = 1;
+	} else if(wmsg->hdr.deadline_ns && _wall_ns() > wmsg->hdr.deadline_ns) {
+		WQ_STAT_INC(q, expired);
+		drop = 1;
+	}
+
+	/* Dropped packets still have to give back whatever holds their payload. */
+	if(drop) {
+		if((wmsg->hdr.flags & WQ_HDR_JOURNALED) && q->journal) {
+			journal_take(q->journal, wmsg->hdr.loc, NULL);
+		} else if((wmsg->hdr.flags & WQ_HDR_KEYED) && q->index) {
+			free(_index_take(q->index, wmsg->hdr.key));
+		}
+		return(-1);
+	}
+
+	msg->type = wmsg->type;
+
+	if(wmsg->hdr.flags & WQ_HDR_JOURNALED) {
+		/* Gone if it was retired through another queue object. */
+		size = q->journal ? journal_take(q->journal, wmsg->hdr.loc, msg->data) : -1;
+		if(size < 0) {
+			return(-1);
+		}
+	} else if(wmsg->hdr.flags & WQ_HDR_KEYED) {
+		entry = q->index ? _index_take(q->index, wmsg->hdr.key) : NULL;
+		if(!entry) {
+			return(-1);
+		}
+		size = entry->size;
+		memcpy(msg->data, entry->data, size);
+		free(entry);
+	} else {
+		memcpy(msg->data, wmsg->data, size);
+	}
+
+	WQ_STAT_INC(q, delivered);
+	TRACE_EVENT(TRACE_DEQUEUE, wmsg->hdr.trace_id);
+
+	return(size);
+}
+
 ssize_t workq_get(WorkQ_t work_queue, workq_msg_t *msg) {
-	int rcv_size = 0;
+	ssize_t rcv_size;
+	wq_msg_t wmsg;
 	wq_t *q = (wq_t*)work_queue;
 
 	if(!q || q->magic != WORKQ_MAGIC) {
@@ -110,22 +783,82 @@ ssize_t workq_get(WorkQ_t work_queue, workq_msg_t *msg) {
 		return(-1);
 	}
 
-	memset(msg, 0, sizeof(msg));
+	memset(msg, 0, sizeof(*msg));
 
 	pthread_mutex_lock(&(q->mutex));
 
-	/* Wait for next message */
-	rcv_size = msgrcv(q->id, msg, sizeof(*msg), -WORKQ_LOWEST_PRIO, 0);
+	do {
+		rcv_size = _wait_get(q, &wmsg);
+		if(rcv_size < 0) {
+			break;
+		}
+		rcv_size = _deliver(q, &wmsg, rcv_size, msg);
+	} while(rcv_size < 0);
+
+	pthread_mutex_unlock(&(q->mutex));
+
+	return(rcv_size);
+}
+
+ssize_t workq_try_get(WorkQ_t work_queue, workq_msg_t *msg) {
+	ssize_t rcv_size;
+	wq_msg_t wmsg;
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	memset(msg, 0, sizeof(*msg));
+
+	/* A consumer parked in workq_get() holds the lock until a packet comes in. */
+	if(pthread_mutex_trylock(&(q->mutex))) {
+		errno = EBUSY;
+		return(-1);
+	}
+
+	do {
+		rcv_size = _recv(q, &wmsg, IPC_NOWAIT);
+		if(rcv_size < 0) {
+			break;
+		}
+		rcv_size = _deliver(q, &wmsg, rcv_size, msg);
+	} while(rcv_size < 0);
 
 	pthread_mutex_unlock(&(q->mutex));
 
 	return(rcv_size);
 }
 
+/*
+ * Callers trace the enqueue before this, a consumer can have the
+ * packet (and trace the dequeue) before msgsnd() even returns.
+ */
+static int _send(wq_t *q, const wq_msg_t *wmsg, size_t size) {
+	int rv;
+
+	pthread_mutex_lock(&(q->send_mutex));
+
+	rv = msgsnd(q->id, wmsg, sizeof(wmsg->hdr) + size, 0);
+
+	pthread_mutex_unlock(&(q->send_mutex));
+
+	if(!rv) {
+		WQ_STAT_INC(q, added);
+	}
+
+	return(rv);
+}
+
 /* TODO: Change to zero copy */
 int workq_add(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio) {
+	return(workq_add_ex(buffer, size, work_queue, prio, 0, NULL));
+}
+
+int workq_add_ex(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio, unsigned long ttl_ms, workq_handle_t *handle) {
 	int rv;
-	workq_msg_t msg;
+	wq_msg_t wmsg;
 	wq_t *q = (wq_t*)work_queue;
 
 	if(!q || q->magic != WORKQ_MAGIC) {
@@ -138,16 +871,227 @@ int workq_add(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long
 		return(-1);
 	}
 
-	memset(&msg, 0, sizeof(msg));
+	/* The handle table lives in this process, another one can't see a cancel. */
+	if(handle && q->key != IPC_PRIVATE) {
+		errno = EINVAL;
+		return(-1);
+	}
 
-	msg.type = prio;
-	memcpy(msg.data, buffer, size);
+	memset(&wmsg, 0, sizeof(wmsg.type) + sizeof(wmsg.hdr));
 
-	pthread_mutex_lock(&(q->send_mutex));
+	wmsg.type = prio;
+	wmsg.hdr.trace_id = TRACE_NEW_ID();
 
-	rv = msgsnd(q->id, &msg, size + sizeof(msg.type), 0);
+	if(ttl_ms) {
+		wmsg.hdr.deadline_ns = _wall_ns() + ttl_ms * 1000000ULL;
+	}
 
-	pthread_mutex_unlock(&(q->send_mutex));
+	if(handle) {
+		wmsg.hdr.handle = _handle_alloc(q);
+		if(!wmsg.hdr.handle) {
+			return(-1);
+		}
+		*handle = wmsg.hdr.handle;
+	}
+
+	if(q->journal) {
+		/* Only the location goes on the SysV queue, the payload is in the journal. */
+		if(journal_append(q->journal, prio, buffer, size, &(wmsg.hdr.loc))) {
+			rv = -1;
+		} else {
+			wmsg.hdr.flags = WQ_HDR_JOURNALED;
+
+			TRACE_EVENT(TRACE_ENQUEUE, wmsg.hdr.trace_id);
+			rv = _send(q, &wmsg, 0);
+			if(rv) {
+				journal_take(q->journal, wmsg.hdr.loc, NULL);
+			} else {
+				journal_commit(q->journal, wmsg.hdr.loc);
+			}
+		}
+	} else {
+		memcpy(wmsg.data, buffer, size);
+
+		TRACE_EVENT(TRACE_ENQUEUE, wmsg.hdr.trace_id);
+		rv = _send(q, &wmsg, size);
+	}
+
+	if(rv && wmsg.hdr.handle) {
+		_handle_release(q, wmsg.hdr.handle);
+	}
+
+	return(rv);
+}
+
+int workq_cancel(WorkQ_t work_queue, workq_handle_t handle) {
+	uint32_t index = (uint32_t)handle;
+	int rv = -1;
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	/* Just a mark, the packet is dropped when it reaches the front of the queue. */
+	pthread_mutex_lock(&(q->handle_mutex));
+
+	if(index < q->num_handles && q->handles[index].gen == (uint32_t)(handle >> 32) &&
+			q->handles[index].state == WQ_HANDLE_PENDING) {
+		q->handles[index].state = WQ_HANDLE_CANCELLED;
+		rv = 0;
+	}
+
+	pthread_mutex_unlock(&(q->handle_mutex));
+
+	if(rv) {
+		/* Already delivered, already cancelled, or never was. */
+		errno = ENOENT;
+	}
+
+	return(rv);
+}
+
+int workq_sync(WorkQ_t work_queue) {
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(!q->journal) {
+		return(0);
+	}
+
+	return(journal_sync(q->journal));
+}
+
+int workq_add_keyed(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio, long key) {
+	int rv;
+	unsigned int bucket;
+	pthread_mutex_t *stripe;
+	wq_entry_t **link;
+	wq_entry_t *entry;
+	wq_msg_t wmsg;
+	wq_t *q = (wq_t*)work_queue;
+
+	if(!q || q->magic != WORKQ_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(!q->index) {
+		return(workq_add(buffer, size, work_queue, prio));
+	}
+
+	if(size > WORKQ_MAX_SIZE) {
+		errno = ENOSPC;
+		return(-1);
+	}
+
+	memset(&wmsg, 0, sizeof(wmsg.type) + sizeof(wmsg.hdr));
+
+	bucket = _bucket_of(key);
+	stripe = &(q->index->stripes[bucket % WORKQ_INDEX_STRIPES]);
+
+	pthread_mutex_lock(stripe);
+
+	/* Destroyed since the check above, nothing would deliver the entry. */
+	if(q->magic != WORKQ_MAGIC) {
+		pthread_mutex_unlock(stripe);
+		errno = ENODEV;
+		return(-1);
+	}
+
+	for(link = &(q->index->buckets[bucket]); *link; link = &((*link)->next)) {
+		if((*link)->key == key) {
+			break;
+		}
+	}
+	entry = *link;
+
+	/* Still pending: fold it in, the token already on the queue will deliver it. */
+	if(entry) {
+		unsigned char merged[WORKQ_MAX_SIZE];
+		const unsigned char *data = buffer;
+		size_t merged_size = size;
+
+		if(q->index->merge) {
+			/* Merge into a copy, an oversized result must leave the pending packet alone. */
+			memcpy(merged, entry->data, entry->size);
+			merged_size = q->index->merge(merged, entry->size, buffer, size);
+			if(merged_size > WORKQ_MAX_SIZE) {
+				pthread_mutex_unlock(stripe);
+				errno = ENOSPC;
+				return(-1);
+			}
+			data = merged;
+		}
+
+		if(merged_size > entry->capacity) {
+			wq_entry_t *grown = realloc(entry, offsetof(wq_entry_t, data) + merged_size);
+
+			if(!grown) {
+				/* realloc() sets errno for us, the pending packet is untouched. */
+				pthread_mutex_unlock(stripe);
+				return(-1);
+			}
+			grown->capacity = merged_size;
+			*link = grown;
+			entry = grown;
+		}
+
+		memcpy(entry->data, data, merged_size);
+		entry->size = merged_size;
+		TRACE_EVENT(TRACE_MERGE, entry->trace_id);
+		pthread_mutex_unlock(stripe);
+
+		WQ_STAT_INC(q, coalesced);
+		return(0);
+	}
+
+	entry = malloc(offsetof(wq_entry_t, data) + size);
+	if(!entry) {
+		pthread_mutex_unlock(stripe);
+		return(-1);
+	}
+
+	entry->key = key;
+	entry->trace_id = TRACE_NEW_ID();
+	entry->size = size;
+	entry->capacity = size;
+	memcpy(entry->data, buffer, size);
+	entry->next = q->index->buckets[bucket];
+	q->index->buckets[bucket] = entry;
+
+	/* Traced under the stripe, before anything can merge into it. */
+	TRACE_EVENT(TRACE_ENQUEUE, entry->trace_id);
+	wmsg.hdr.trace_id = entry->trace_id;
+
+	pthread_mutex_unlock(stripe);
+
+	/* Sent outside the stripe lock, msgsnd() can block on a full queue
+	 * and the consumer needs the stripe to drain it. The entry is in the
+	 * index before the token exists, so a consumer always finds it.
+	 */
+	wmsg.type = prio;
+	wmsg.hdr.flags = WQ_HDR_KEYED;
+	wmsg.hdr.key = key;
+
+	/* Other adds may already have merged into the entry, don't give it
+	 * up to a signal.
+	 */
+	do {
+		rv = _send(q, &wmsg, 0);
+	} while(rv && errno == EINTR);
+
+	if(rv) {
+		/* No token, so nobody would ever deliver the entry. Anything
+		 * merged into it in the meantime goes down with it, see workq.h.
+		 */
+		free(_index_take(q->index, key));
+	}
 
 	return(rv);
 }
@@ -25,12 +25,55 @@
 #ifndef WORK_QUEUE_H
 #define WORK_QUEUE_H 1
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define WORKQ_MAX_SIZE (2048)
 
 #define WORKQ_LOWEST_PRIO (10)
 
+/** Consumer wait policies, see workq_set_wait_policy(). */
+typedef enum {
+	WORKQ_WAIT_PARK = 0, /**< Sleep in the kernel until a packet arrives (default). */
+	WORKQ_WAIT_SPIN, /**< Poll without ever sleeping. */
+	WORKQ_WAIT_SPIN_PARK, /**< Poll for a fixed budget, then sleep. */
+	WORKQ_WAIT_ADAPTIVE, /**< Like WORKQ_WAIT_SPIN_PARK, budget learned from recent arrivals. */
+} workq_wait_t;
+
+/**
+ * Merge callback for coalescing queues, see workq_set_coalesce().
+ *
+ * Folds an incoming packet into the pending one with the same key.
+ * The pending buffer has room for WORKQ_MAX_SIZE bytes.
+ *
+ * return the new size of the pending packet, a size over WORKQ_MAX_SIZE
+ * rejects the merge
+ */
+typedef size_t (*workq_merge_t)(unsigned char *pending, size_t pending_size, const unsigned char *incoming, size_t incoming_size);
+
+/** Work queue statistics, see workq_get_stats(). */
+typedef struct {
+	unsigned long added; /**< Packets put on the queue. */
+	unsigned long delivered; /**< Packets handed out by workq_get(). */
+	unsigned long coalesced; /**< Keyed packets merged into a pending one. */
+	unsigned long cancelled; /**< Packets dropped because they were cancelled. */
+	unsigned long expired; /**< Packets dropped because their time to live ran out. */
+} workq_stats_t;
+
+/** Handle to a queued packet, see workq_add_ex(). */
+typedef uint64_t workq_handle_t;
+
+/** Journal options, see workq_init_journaled(). Zero fields use the defaults. */
+typedef struct {
+	size_t segment_size; /**< Bytes per journal segment file, only used when the journal is created. */
+	unsigned int sync_every; /**< Flush after this many packets. */
+	unsigned long sync_interval_ms; /**< Or once the oldest unflushed packet is this old, even if no more come. */
+} workq_journal_opts_t;
+
 /** Opaque handle to a work queue object. */
 typedef void * WorkQ_t;
 
@@ -50,9 +93,38 @@ typedef struct {
  */
 WorkQ_t workq_init(const char *keyfile, int subsystem_id);
 
+/**
+ * @brief Create and initialize a work queue object backed by a journal.
+ *
+ * Every packet is appended to a memory mapped journal in journal_dir
+ * and retired when it is retrieved, so pending packets survive a crash
+ * or reboot. When the SysV queue has to be created (nothing was
+ * attached to it) the packets still pending in the journal are put
+ * back on the queue in the background. When it already exists only the
+ * packets whose producer died between the append and the send are.
+ *
+ * The journal is flushed in batches, see workq_journal_opts_t. Packets
+ * added since the last flush can be lost in a crash, and packets
+ * retrieved since then can be delivered again.
+ *
+ * Every process using the queue must open it with the same journal_dir.
+ * Journaled queues can't coalesce, and need a keyfile: a private queue
+ * would be new on every open, and each one would replay the journal.
+ *
+ * @param keyfile a filename to generate a key from, much like SysV ftok(), not NULL
+ * @param subsystem_id subsystem (for use with multiple queues)
+ * @param journal_dir an existing directory for the journal files
+ * @param opts journal options, or NULL for the defaults
+ *
+ * return a work queue object
+ */
+WorkQ_t workq_init_journaled(const char *keyfile, int subsystem_id, const char *journal_dir, const workq_journal_opts_t *opts);
+
 /**
  * @brief Clean up a work queue object.
  *
+ * Packets still pending on a journaled queue stay in the journal.
+ *
  * @param work_queue the work queue object to destroy
  *
  * return zero on success, something else on error
@@ -71,6 +143,75 @@ int workq_destroy(WorkQ_t work_queue);
  */
 ssize_t workq_get(WorkQ_t work_queue, workq_msg_t *msg);
 
+/**
+ * @brief Get a work queue packet if one is ready, without waiting.
+ *
+ * @param work_queue the work queue to retrieve from
+ * @param msg object to be filled in with the next work packet
+ *
+ * return the size of the work queue packet, -1 with errno ENOMSG if the
+ * queue is empty, or EBUSY if another consumer is waiting in workq_get()
+ */
+ssize_t workq_try_get(WorkQ_t work_queue, workq_msg_t *msg);
+
+/**
+ * @brief Add a work packet with a time to live, optionally returning a handle.
+ *
+ * A packet whose time to live runs out before it is retrieved is dropped
+ * by workq_get() instead of being delivered. Deadlines use the wall
+ * clock, so they hold across processes. They are not kept in the
+ * journal, a recovered packet never expires.
+ *
+ * The handle can be passed to workq_cancel() while the packet is still
+ * queued. Handles only work on private queues (no keyfile).
+ *
+ * @param buffer the work queue packet
+ * @param size the size of the work queue packet
+ * @param work_queue the work queue to add to
+ * @param prio the priority of the work queue packet
+ * @param ttl_ms time to live in milliseconds, 0 to never expire
+ * @param handle filled in with the packet's handle, or NULL if not needed
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_add_ex(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio, unsigned long ttl_ms, workq_handle_t *handle);
+
+/**
+ * @brief Cancel a queued packet.
+ *
+ * The packet is marked in constant time and dropped by workq_get() when
+ * it comes up, without being delivered.
+ *
+ * @param work_queue the work queue the packet was added to
+ * @param handle the handle from workq_add_ex()
+ *
+ * return zero on success, -1 if the packet was already delivered or cancelled
+ */
+int workq_cancel(WorkQ_t work_queue, workq_handle_t handle);
+
+/**
+ * @brief Set how consumers wait for packets.
+ *
+ * Parking costs a kernel sleep and wakeup per packet, which dominates
+ * jobs that only take microseconds. Spinning keeps the consumer on the
+ * CPU polling the queue instead. Only one consumer polls at a time, the
+ * others wait their turn on the queue mutex.
+ *
+ * With WORKQ_WAIT_ADAPTIVE consumers spin for twice the recent average
+ * time between packets, or park right away if packets usually arrive
+ * further apart than spin_ns.
+ *
+ * Safe to call while consumers wait, it never blocks on them. Spinning
+ * consumers switch on their next poll, parked ones after their next packet.
+ *
+ * @param work_queue the work queue
+ * @param policy the wait policy
+ * @param spin_ns spin budget in nanoseconds, the upper limit for WORKQ_WAIT_ADAPTIVE
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_set_wait_policy(WorkQ_t work_queue, workq_wait_t policy, unsigned long spin_ns);
+
 /**
  * @brief Add a work packet to a work queue.
  *
@@ -83,4 +224,76 @@ ssize_t workq_get(WorkQ_t work_queue, workq_msg_t *msg);
  */
 int workq_add(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio);
 
+/**
+ * @brief Enable coalescing of keyed packets.
+ *
+ * While a packet added with workq_add_keyed() is still pending, later
+ * packets with the same key are merged into it instead of being queued.
+ * The merge callback does the merging; if it is NULL the last write
+ * wins. A merged packet keeps the priority and position of the first.
+ *
+ * Pending payloads are held in an index in this process, so only
+ * private queues (no keyfile) can coalesce. Must be called before any
+ * keyed packets are added.
+ *
+ * @param work_queue the work queue
+ * @param merge the merge callback, or NULL for last write wins
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_set_coalesce(WorkQ_t work_queue, workq_merge_t merge);
+
+/**
+ * @brief Add a keyed work packet to a work queue.
+ *
+ * Same as workq_add(), except that on a coalescing queue the packet is
+ * merged into a pending packet with the same key if there is one. If
+ * the merge callback rejects the merge the pending packet is left as it
+ * was and the add fails with ENOSPC.
+ *
+ * The add that creates a pending packet sends the token for it, retrying
+ * if a signal interrupts the send. If the send still fails (say the
+ * queue was destroyed meanwhile) that add fails and the pending packet
+ * is dropped, along with anything merged into it in the meantime, even
+ * though those adds returned zero and were counted as coalesced.
+ *
+ * @param buffer the work queue packet
+ * @param size the size of the work queue packet
+ * @param work_queue the work queue to add to
+ * @param prio the priority of the work queue packet
+ * @param key the coalescing key
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_add_keyed(const unsigned char *buffer, size_t size, WorkQ_t work_queue, long prio, long key);
+
+/**
+ * @brief Flush a journaled queue's journal.
+ *
+ * Makes every packet added and retrieved so far durable without
+ * waiting for the next batch. Does nothing on a queue without one.
+ *
+ * @param work_queue the work queue
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_sync(WorkQ_t work_queue);
+
+/**
+ * @brief Get a work queue's statistics.
+ *
+ * Counters are kept per queue object, so they only cover packets
+ * added and retrieved through it.
+ *
+ * @param work_queue the work queue
+ * @param stats filled in with the statistics
+ *
+ * return zero on success, anything else is failure
+ */
+int workq_get_stats(WorkQ_t work_queue, workq_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* WORK_QUEUE_H */
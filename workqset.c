@@ -0,0 +1,365 @@
+/*
+ * workqset.c
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * Weighted round robin over work queues, with a token bucket per queue.
+ *
+ * Packets all cost the same here: SysV queues can't be peeked, so the
+ * size of the next packet isn't known until it has been taken. A queue
+ * is given its weight in packets when its turn comes up, and loses
+ * whatever is left when it is empty or over its rate, which is deficit
+ * round robin with a unit cost.
+ *
+ * The token bucket is kept as a theoretical arrival time (GCRA): one
+ * timestamp per queue instead of a token count and a refill time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "workqset.h"
+
+#define WORKQSET_MAGIC (0x57715374)
+
+/* Polling backoff of an idle set. */
+#define WORKQSET_MIN_BACKOFF_NS (50 * 1000ULL)
+#define WORKQSET_MAX_BACKOFF_NS (5 * 1000 * 1000ULL)
+
+typedef struct ws_member_t {
+	WorkQ_t queue;
+	unsigned int weight;
+	uint64_t interval_ns; /* Time per packet under the rate limit, 0 for none. */
+	uint64_t tolerance_ns; /* How far ahead of the rate the burst may run. */
+	uint64_t tat_ns; /* When the next packet is due at the configured rate. */
+	uint64_t throttled_tat_ns; /* The tat_ns last counted as throttled. */
+	unsigned long delivered;
+	unsigned long throttled;
+} ws_member_t;
+
+typedef struct ws_t {
+	uint32_t magic;
+	unsigned int polling;
+	pthread_mutex_t mutex;
+	pthread_cond_t turn_cond; /* Consumers waiting to become the poller. */
+	pthread_cond_t poll_cond; /* The poller's backoff sleep. */
+	uint64_t backoff_ns;
+	ws_member_t *members;
+	unsigned int num_members;
+	unsigned int current;
+	unsigned int deficit; /* Packets left in the current queue's turn. */
+} ws_t;
+
+static uint64_t _now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void _set_limits(ws_member_t *m, unsigned int weight, unsigned long rate, unsigned int burst) {
+	m->weight = weight;
+	m->interval_ns = rate ? 1000000000ULL / rate : 0;
+	if(rate && !m->interval_ns) {
+		/* Over a billion a second is as good as no limit. */
+		m->interval_ns = 1;
+	}
+	m->tolerance_ns = burst > 1 ? (burst - 1) * m->interval_ns : 0;
+}
+
+/* WARNING: Only called with the set mutex held. */
+static void _next_turn(ws_t *s) {
+	s->current = (s->current + 1) % s->num_members;
+	s->deficit = s->members[s->current].weight;
+}
+
+/* WARNING: Only called with the set mutex held.
+ * Takes a packet from the first queue in turn that has one and is under
+ * its rate. Otherwise lowers *wait_ns to when a throttled queue frees up.
+ */
+static ssize_t _scan(ws_t *s, workq_msg_t *msg, unsigned int *member, uint64_t *wait_ns) {
+	unsigned int visited;
+	ssize_t rcv_size;
+	uint64_t now = _now_ns();
+
+	for(visited = 0; visited < s->num_members; ++visited, _next_turn(s)) {
+		ws_member_t *m = &(s->members[s->current]);
+
+		if(m->interval_ns && m->tat_ns > now + m->tolerance_ns) {
+			/* Polled again and again until the packet is due, that's still one turn. */
+			if(m->throttled_tat_ns != m->tat_ns) {
+				m->throttled_tat_ns = m->tat_ns;
+				m->throttled++;
+			}
+			if(m->tat_ns - m->tolerance_ns - now < *wait_ns) {
+				*wait_ns = m->tat_ns - m->tolerance_ns - now;
+			}
+			continue;
+		}
+
+		/* Empty, busy or gone, the queue loses its turn either way. */
+		rcv_size = workq_try_get(m->queue, msg);
+		if(rcv_size < 0) {
+			continue;
+		}
+
+		if(m->interval_ns) {
+			m->tat_ns = (m->tat_ns > now ? m->tat_ns : now) + m->interval_ns;
+		}
+		m->delivered++;
+
+		if(member) {
+			*member = s->current;
+		}
+		if(!--s->deficit) {
+			_next_turn(s);
+		}
+
+		return(rcv_size);
+	}
+
+	errno = ENOMSG;
+	return(-1);
+}
+
+WorkQSet_t workqset_init(void) {
+	pthread_condattr_t attr;
+	ws_t *s;
+
+	s = calloc(1, sizeof(ws_t));
+	if(!s) {
+		return(NULL);
+	}
+
+	s->magic = WORKQSET_MAGIC;
+	s->backoff_ns = WORKQSET_MIN_BACKOFF_NS;
+
+	pthread_mutex_init(&(s->mutex), NULL);
+	pthread_cond_init(&(s->turn_cond), NULL);
+
+	/* Backoff deadlines must not jump with the wall clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(s->poll_cond), &attr);
+	pthread_condattr_destroy(&attr);
+
+	return((WorkQSet_t)s);
+}
+
+int workqset_destroy(WorkQSet_t set) {
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+	s->magic = 0;
+
+	/* Kick out the consumers blocked on the set. */
+	pthread_cond_broadcast(&(s->turn_cond));
+	pthread_cond_broadcast(&(s->poll_cond));
+
+	free(s->members);
+	s->members = NULL;
+	s->num_members = 0;
+
+	pthread_mutex_unlock(&(s->mutex));
+
+	/* The set object itself stays, like workq_destroy(). A caller may have
+	 * passed the magic check and not have the mutex yet; waiting for the
+	 * ones inside workqset_get() can't account for those.
+	 */
+
+	return(0);
+}
+
+int workqset_add(WorkQSet_t set, WorkQ_t work_queue, unsigned int weight, unsigned long rate, unsigned int burst) {
+	ws_member_t *members;
+	int rv;
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(!work_queue || !weight) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+
+	if(s->magic != WORKQSET_MAGIC) {
+		pthread_mutex_unlock(&(s->mutex));
+		errno = ENODEV;
+		return(-1);
+	}
+
+	members = realloc(s->members, (s->num_members + 1) * sizeof(ws_member_t));
+	if(!members) {
+		pthread_mutex_unlock(&(s->mutex));
+		return(-1);
+	}
+	s->members = members;
+
+	rv = s->num_members++;
+	memset(&(members[rv]), 0, sizeof(ws_member_t));
+	members[rv].queue = work_queue;
+	_set_limits(&(members[rv]), weight, rate, burst);
+
+	if(!rv) {
+		s->deficit = weight;
+	}
+
+	/* The new queue may already hold packets. */
+	pthread_cond_signal(&(s->poll_cond));
+	pthread_mutex_unlock(&(s->mutex));
+
+	return(rv);
+}
+
+int workqset_set_limits(WorkQSet_t set, unsigned int member, unsigned int weight, unsigned long rate, unsigned int burst) {
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	if(!weight) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+
+	if(s->magic != WORKQSET_MAGIC || member >= s->num_members) {
+		pthread_mutex_unlock(&(s->mutex));
+		errno = (s->magic != WORKQSET_MAGIC) ? ENODEV : EINVAL;
+		return(-1);
+	}
+
+	_set_limits(&(s->members[member]), weight, rate, burst);
+
+	pthread_cond_signal(&(s->poll_cond));
+	pthread_mutex_unlock(&(s->mutex));
+
+	return(0);
+}
+
+ssize_t workqset_get(WorkQSet_t set, workq_msg_t *msg, unsigned int *member) {
+	struct timespec ts;
+	ssize_t rcv_size = -1;
+	uint64_t wait_ns;
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+
+	while(1) {
+		if(s->magic != WORKQSET_MAGIC) {
+			errno = ENODEV;
+			rcv_size = -1;
+			break;
+		}
+
+		/* One consumer polls, the rest wait their turn. */
+		if(s->polling) {
+			pthread_cond_wait(&(s->turn_cond), &(s->mutex));
+			continue;
+		}
+
+		wait_ns = s->backoff_ns;
+		if(s->num_members) {
+			rcv_size = _scan(s, msg, member, &wait_ns);
+			if(rcv_size >= 0) {
+				/* Where there was one packet there may be more, hand polling on. */
+				s->backoff_ns = WORKQSET_MIN_BACKOFF_NS;
+				pthread_cond_signal(&(s->turn_cond));
+				break;
+			}
+		}
+
+		s->polling = 1;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += (ts.tv_nsec + wait_ns) / 1000000000ULL;
+		ts.tv_nsec = (ts.tv_nsec + wait_ns) % 1000000000ULL;
+		/* Waiting out a rate limit says nothing about how busy the queues are. */
+		if(pthread_cond_timedwait(&(s->poll_cond), &(s->mutex), &ts) == ETIMEDOUT &&
+				wait_ns == s->backoff_ns && s->backoff_ns < WORKQSET_MAX_BACKOFF_NS) {
+			s->backoff_ns *= 2;
+		}
+		s->polling = 0;
+	}
+
+	pthread_mutex_unlock(&(s->mutex));
+
+	return(rcv_size);
+}
+
+void workqset_wake(WorkQSet_t set) {
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		return;
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+	s->backoff_ns = WORKQSET_MIN_BACKOFF_NS;
+	pthread_cond_signal(&(s->poll_cond));
+	pthread_mutex_unlock(&(s->mutex));
+}
+
+int workqset_get_stats(WorkQSet_t set, unsigned int member, workqset_stats_t *stats) {
+	ws_t *s = (ws_t*)set;
+
+	if(!s || s->magic != WORKQSET_MAGIC) {
+		errno = ENODEV;
+		return(-1);
+	}
+
+	pthread_mutex_lock(&(s->mutex));
+
+	if(s->magic != WORKQSET_MAGIC || member >= s->num_members) {
+		pthread_mutex_unlock(&(s->mutex));
+		errno = (s->magic != WORKQSET_MAGIC) ? ENODEV : EINVAL;
+		return(-1);
+	}
+
+	stats->delivered = s->members[member].delivered;
+	stats->throttled = s->members[member].throttled;
+	pthread_mutex_unlock(&(s->mutex));
+
+	return(0);
+}
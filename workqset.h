@@ -0,0 +1,138 @@
+/*
+ * workqset.h
+ * This file is part of thread_pool - Thread Pool server
+ *
+ * Copyright (C) 2012 - Ian Ganse
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; specifically version 2.x of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#pragma once
+
+#ifndef WORK_QUEUE_SET_H
+#define WORK_QUEUE_SET_H 1
+
+#include <sys/types.h>
+
+#include "workq.h"
+
+/** Opaque handle to a work queue set object. */
+typedef void * WorkQSet_t;
+
+/** Per-queue statistics, see workqset_get_stats(). */
+typedef struct {
+	unsigned long delivered; /**< Packets taken from the queue. */
+	unsigned long throttled; /**< Turns the queue lost to its rate limit, however often it was polled meanwhile. */
+} workqset_stats_t;
+
+/**
+ * @brief Create an empty work queue set.
+ *
+ * A set lets consumers take packets from several work queues at once,
+ * typically one queue per tenant. Queues are served by weighted round
+ * robin: on its turn a queue hands out up to its weight in packets,
+ * and a queue that runs dry gives up the rest of its turn. A queue can
+ * also be rate limited with a token bucket, so a noisy tenant gets its
+ * share and no more even while the others are idle.
+ *
+ * SysV queues can't be waited on together, so an idle set polls its
+ * queues with a backoff, at most 5 ms apart.
+ * Only one consumer polls at a time, the others sleep.
+ *
+ * The set is process private, its queues need not be.
+ *
+ * return a work queue set object, or NULL on failure (errno is set)
+ */
+WorkQSet_t workqset_init(void);
+
+/**
+ * @brief Clean up a work queue set object.
+ *
+ * Consumers blocked in workqset_get() are woken and fail with ENODEV.
+ * The queues themselves are left alone. The set object is not freed, so
+ * calls that race with the destroy, or come after it, fail with ENODEV
+ * safely.
+ *
+ * @param set the work queue set object to destroy
+ *
+ * return zero on success, something else on error
+ */
+int workqset_destroy(WorkQSet_t set);
+
+/**
+ * @brief Add a work queue to a set.
+ *
+ * Packets from the queue should only be taken through the set; a
+ * consumer parked in workq_get() on it stalls the queue's turns.
+ *
+ * @param set the work queue set
+ * @param work_queue the queue to add
+ * @param weight packets the queue may hand out per turn, at least 1
+ * @param rate packets per second the queue may hand out, 0 for no limit
+ * @param burst packets the queue may hand out back to back under the limit
+ *
+ * return the queue's number in the set, or -1 on failure (errno is set)
+ */
+int workqset_add(WorkQSet_t set, WorkQ_t work_queue, unsigned int weight, unsigned long rate, unsigned int burst);
+
+/**
+ * @brief Change a queue's weight and rate limit.
+ *
+ * @param set the work queue set
+ * @param member the queue's number returned by workqset_add()
+ * @param weight packets the queue may hand out per turn, at least 1
+ * @param rate packets per second the queue may hand out, 0 for no limit
+ * @param burst packets the queue may hand out back to back under the limit
+ *
+ * return zero on success, anything else is failure
+ */
+int workqset_set_limits(WorkQSet_t set, unsigned int member, unsigned int weight, unsigned long rate, unsigned int burst);
+
+/**
+ * @brief Get a work packet from the queue whose turn it is.
+ *
+ * Blocks until one of the queues has a packet it may hand out.
+ *
+ * @param set the work queue set to retrieve from
+ * @param msg object to be filled in with the next work packet
+ * @param member filled in with the number of the queue the packet came from, may be NULL
+ *
+ * return the size of the work queue packet, -1 on error
+ */
+ssize_t workqset_get(WorkQSet_t set, workq_msg_t *msg, unsigned int *member);
+
+/**
+ * @brief Cut the polling backoff short.
+ *
+ * Producers in the same process can call this after adding a packet
+ * so an idle set picks it up right away.
+ *
+ * @param set the work queue set
+ */
+void workqset_wake(WorkQSet_t set);
+
+/**
+ * @brief Get a queue's statistics.
+ *
+ * @param set the work queue set
+ * @param member the queue's number returned by workqset_add()
+ * @param stats filled in with the statistics
+ *
+ * return zero on success, anything else is failure
+ */
+int workqset_get_stats(WorkQSet_t set, unsigned int member, workqset_stats_t *stats);
+
+#endif /* WORK_QUEUE_SET_H */